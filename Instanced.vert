@@ -0,0 +1,41 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec4 vertexColor;   // alpha marks the faces a highlight recolours
+layout (location = 2) in vec2 vertexTexCoord;
+
+// per instance data : translation in xyz and rotation about Y (degrees) in w
+layout (location = 3) in vec4 instanceTransform;
+layout (location = 4) in float instanceHighlight;
+
+// per frame data : shared by every program, updated once per frame
+layout (std140) uniform FrameData {
+    mat4 VP;
+    vec4 playerPosition;
+    vec4 playerHeading;
+    float spotlightCos;
+};
+
+// output data : used by fragment shader
+out vec2 fragTexCoord;
+out float fragHighlight;
+out vec3 objectPositionout;
+void main ()
+{
+    float angle = radians(instanceTransform.w);
+    mat4 model = mat4(cos(angle), 0, -sin(angle), 0,
+                      0, 1, 0, 0,
+                      sin(angle), 0, cos(angle), 0,
+                      instanceTransform.xyz, 1);
+
+    fragTexCoord = vertexTexCoord;
+
+    // The top face of a tile is recoloured under the hero
+    fragHighlight = instanceHighlight > 0.5 && vertexColor.a > 0.5 ? 1.0 : 0.0;
+
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * model * vec4(vertexPosition, 1);
+
+    objectPositionout = instanceTransform.xyz + vertexPosition;
+}
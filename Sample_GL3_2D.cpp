@@ -6,6 +6,10 @@
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #define PI M_PI
 #define GLM_FORCE_RADIANS
@@ -19,6 +23,13 @@ using namespace std;
 #include <ao/ao.h>
 #include <mpg123.h>
 #include<thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #define ll long long
 #define mp(x,y) make_pair(x,y)
@@ -29,101 +40,672 @@ using namespace std;
 
 #define BITS 8
 
-struct VAO {
-    GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+/* GPU objects are held through GpuHandle, a reference counted GL name. When
+   the last copy goes away the name is queued, and flushGpuGarbage deletes the
+   queue once the frame is drawn, never in the middle of it. GL thread only */
+enum GpuKind { GPU_BUFFER, GPU_VERTEX_ARRAY, GPU_SHADER, GPU_PROGRAM, GPU_FRAMEBUFFER, GPU_RENDERBUFFER };
 
+struct GpuObject {
+    GpuKind kind;
+    GLuint name;
+};
+
+struct GpuStats {
+    long created;
+    long deleted;
+} gpuStats;
+
+vector<GpuObject> gpuGarbage;
+
+class GpuHandle {
+public:
+    GpuHandle() : refs(NULL) { object.kind = GPU_BUFFER; object.name = 0; }
+    GpuHandle(GpuKind kind, GLuint name) : refs(new int(1)) { object.kind = kind; object.name = name; gpuStats.created++; }
+    GpuHandle(const GpuHandle& other) : object(other.object), refs(other.refs) { if (refs) ++*refs; }
+    ~GpuHandle() { release(); }
+
+    GpuHandle& operator= (const GpuHandle& other)
+    {
+        if (other.refs)
+            ++*other.refs;
+        release();
+        object = other.object;
+        refs = other.refs;
+        return *this;
+    }
+
+    operator GLuint () const { return object.name; }
+
+    void reset ()
+    {
+        release();
+        object.name = 0;
+        refs = NULL;
+    }
+
+private:
+    void release ()
+    {
+        if (refs && --*refs == 0) {
+            delete refs;
+            gpuGarbage.push_back(object);
+        }
+    }
+
+    GpuObject object;
+    int *refs;
+};
+
+GpuHandle genBuffer ()
+{
+    GLuint name;
+    glGenBuffers(1, &name);
+    return GpuHandle(GPU_BUFFER, name);
+}
+
+GpuHandle genVertexArray ()
+{
+    GLuint name;
+    glGenVertexArrays(1, &name);
+    return GpuHandle(GPU_VERTEX_ARRAY, name);
+}
+
+GpuHandle genFramebuffer ()
+{
+    GLuint name;
+    glGenFramebuffers(1, &name);
+    return GpuHandle(GPU_FRAMEBUFFER, name);
+}
+
+GpuHandle genRenderbuffer ()
+{
+    GLuint name;
+    glGenRenderbuffers(1, &name);
+    return GpuHandle(GPU_RENDERBUFFER, name);
+}
+
+GpuHandle createShader (GLenum type)
+{
+    return GpuHandle(GPU_SHADER, glCreateShader(type));
+}
+
+GpuHandle createProgram ()
+{
+    return GpuHandle(GPU_PROGRAM, glCreateProgram());
+}
+
+/* Delete what was released since the last frame - call between frames */
+void flushGpuGarbage ()
+{
+    for (size_t i = 0; i < gpuGarbage.size(); i++) {
+        GLuint name = gpuGarbage[i].name;
+        switch (gpuGarbage[i].kind) {
+            case GPU_BUFFER: glDeleteBuffers(1, &name); break;
+            case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &name); break;
+            case GPU_SHADER: glDeleteShader(name); break;
+            case GPU_PROGRAM: glDeleteProgram(name); break;
+            case GPU_FRAMEBUFFER: glDeleteFramebuffers(1, &name); break;
+            case GPU_RENDERBUFFER: glDeleteRenderbuffers(1, &name); break;
+        }
+    }
+    gpuStats.deleted += gpuGarbage.size();
+    gpuGarbage.clear();
+}
+
+/* Single producer / single consumer ring, no locks. One thread only pushes
+   and one other only pops; clear() only while neither is using it */
+template <typename T, unsigned N>
+struct SpscRing {
+    static_assert((N & (N-1)) == 0, "ring size must be a power of two");
+
+    T items[N];
+    atomic<unsigned> head;
+    atomic<unsigned> tail;
+
+    void clear ()
+    {
+        head = 0;
+        tail = 0;
+    }
+
+    bool push (const T& item)
+    {
+        unsigned t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N)
+            return false;
+        items[t % N] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop (T& item)
+    {
+        unsigned h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        item = items[h % N];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+/* One vertex of the shared mesh buffers, 20 bytes interleaved */
+struct Vertex {
+    GLfloat position[3];
+    GLubyte color[4];       // normalized, alpha set on the faces a highlight recolours
+    GLushort texCoord[2];   // normalized to 0..1
+};
+
+/* One shape in the shared mesh buffers, drawn with indices */
+struct Mesh {
     GLenum PrimitiveMode;
     GLenum FillMode;
-    int NumVertices;
+    int FirstIndex;         // where its indices start in the shared index buffer
+    int NumIndices;
+    float Radius;           // of a sphere about the origin holding every vertex, for culling
 };
-typedef struct VAO VAO;
+
+/* Every shape is stored once in one vertex/index buffer pair. Objects refer
+   to a shape by its handle, its position in list */
+struct MeshRegistry {
+    GpuHandle VertexArrayID;
+    GpuHandle VertexBuffer;
+    GpuHandle IndexBuffer;
+    vector<Vertex> vertices;
+    vector<GLushort> indices;
+    vector<Mesh> list;
+    map<string,int> byName;     // shapes made by the create* helpers, by size and colour
+    bool dirty;                 // shapes were added since the last upload
+} meshes;
 
 struct GLMatrices {
     glm::mat4 projection;
     glm::mat4 model;
     glm::mat4 view;
-    GLuint MatrixID;
 } Matrices;
 
-GLuint programID;
+/* A linked program with its uniform locations resolved once */
+struct ShaderProgram {
+    GpuHandle ProgramID;
+    GLint ModelID;
+    GLint ObjectPositionID;
+};
+typedef struct ShaderProgram ShaderProgram;
+
+/* Each kind of level lighting is its own build of the shaders, picked by a
+   define, so that fragments only run the lighting their level uses */
+enum Lighting { LIGHT_PLAIN, LIGHT_SPOTLIGHT, LIGHT_DIM, LIGHTING_VARIANTS };
+
+ShaderProgram objectPrograms[LIGHTING_VARIANTS],instancedPrograms[LIGHTING_VARIANTS];
+Lighting frameLighting;         // the variant the frame being drawn uses
+
+#define SPOTLIGHT_HALF_ANGLE 25.0f
+
+/* Values shared by every draw of a frame - std140 layout of the FrameData block.
+   The lighting inputs are worked out here once instead of for every fragment */
+struct FrameUniforms {
+    glm::mat4 VP;
+    glm::vec4 playerPosition;
+    glm::vec4 playerHeading;    // unit vector the hero walks along
+    GLfloat spotlightCos;       // cosine of SPOTLIGHT_HALF_ANGLE
+    GLfloat padding[3];
+};
+
+#define FRAME_UNIFORM_BINDING 0
+GpuHandle frameUniformBuffer;
+
+/* Linked programs are kept in SHADER_CACHE_DIR as driver binaries, named by a
+   hash of both sources and the driver strings. A file whose driver doesn't
+   match, or that the driver refuses, is recompiled and written again */
+#define SHADER_CACHE_DIR "shadercache"
+#define SHADER_CACHE_MAGIC "SPB1"
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+bool readFile(const char* path,vector<unsigned char>& data);
+bool writeBytes(const char* path,const vector<unsigned char>& data);
 
-    // Create the shaders
-    GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-    GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Read a whole shader source in one go */
+bool readShaderSource(const char* path,string& source)
+{
+    ifstream stream(path, ios::in | ios::binary);
+    if(!stream.is_open())
+    {
+        fprintf(stderr, "Error: could not open shader %s\n", path);
+        return false;
+    }
+    stringstream text;
+    text << stream.rdbuf();
+    source = text.str();
+    return true;
+}
+
+/* 64 bit FNV-1a, continued from hash */
+unsigned long long hashBytes(unsigned long long hash,const void* data,size_t size)
+{
+    const unsigned char* bytes=(const unsigned char*)data;
+    for(size_t i=0;i<size;i++)
+    {
+        hash^=bytes[i];
+        hash*=1099511628211ULL;
+    }
+    return hash;
+}
 
-    // Read the Vertex Shader code from the file
-    std::string VertexShaderCode;
-    std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-    if(VertexShaderStream.is_open())
+/* Identifies the driver a program binary came from */
+string driverString()
+{
+    string driver;
+    GLenum names[3]={GL_VENDOR,GL_RENDERER,GL_VERSION};
+    for(int i=0;i<3;i++)
     {
-        std::string Line = "";
-        while(getline(VertexShaderStream, Line))
-            VertexShaderCode += "\n" + Line;
-        VertexShaderStream.close();
+        const GLubyte* name=glGetString(names[i]);
+        if(name)
+            driver+=(const char*)name;
+        driver+="\n";
     }
+    return driver;
+}
+
+/* Print the info log of a shader or program, but only when there is one */
+void printInfoLog(GLuint object,bool program,const char* what)
+{
+    GLint length=0;
+    if(program)
+        glGetProgramiv(object, GL_INFO_LOG_LENGTH, &length);
+    else
+        glGetShaderiv(object, GL_INFO_LOG_LENGTH, &length);
+    if(length<=1)
+        return;
+    vector<char> log(length);
+    if(program)
+        glGetProgramInfoLog(object, length, NULL, &log[0]);
+    else
+        glGetShaderInfoLog(object, length, NULL, &log[0]);
+    fprintf(stderr, "%s:\n%s\n", what, &log[0]);
+}
 
-    // Read the Fragment Shader code from the file
-    std::string FragmentShaderCode;
-    std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-    if(FragmentShaderStream.is_open()){
-        std::string Line = "";
-        while(getline(FragmentShaderStream, Line))
-            FragmentShaderCode += "\n" + Line;
-        FragmentShaderStream.close();
+/* Check a compiled stage, printing its log */
+bool shaderCompiled(GLuint shader,const char* path)
+{
+    GLint status=GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    printInfoLog(shader, false, path);
+    if(status!=GL_TRUE)
+    {
+        fprintf(stderr, "Error: could not compile shader %s\n", path);
+        return false;
     }
+    return true;
+}
+
+/* Try the cached binary, false if there is none or the driver won't take it */
+bool loadProgramBinary(GLuint program,const char* path,const string& driver)
+{
+    vector<unsigned char> data;
+    if(!readFile(path, data) || data.size()<12 || memcmp(&data[0], SHADER_CACHE_MAGIC, 4))
+        return false;
+    GLuint format,driverLength;
+    memcpy(&format, &data[4], 4);
+    memcpy(&driverLength, &data[8], 4);
+    if(data.size()<=12+(size_t)driverLength || driver.compare(0, string::npos, (const char*)&data[12], driverLength))
+        return false;
+
+    size_t start=12+driverLength;
+    glProgramBinary(program, format, &data[start], data.size()-start);
+    GLint status=GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    return status==GL_TRUE;
+}
+
+void saveProgramBinary(GLuint program,const char* path,const string& driver)
+{
+    GLint size=0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if(size<=0)
+        return;
+    GLuint driverLength=driver.size();
+    vector<unsigned char> data(12+driverLength+size);
+    GLenum format;
+    GLsizei written=0;
+    glGetProgramBinary(program, size, &written, &format, &data[12+driverLength]);
+    if(written<=0)
+        return;
+    data.resize(12+driverLength+written);
+    memcpy(&data[0], SHADER_CACHE_MAGIC, 4);
+    GLuint format32=format;
+    memcpy(&data[4], &format32, 4);
+    memcpy(&data[8], &driverLength, 4);
+    memcpy(&data[12], driver.data(), driverLength);
+
+    mkdir(SHADER_CACHE_DIR, 0755);
+    writeBytes(path, data);
+}
+
+/* A program being built from a shader pair. Nothing is checked until the
+   build is finished, so a driver with GL_ARB_parallel_shader_compile can
+   compile and link on its own threads in the meantime */
+struct ProgramBuild {
+    string vertexPath, fragmentPath;
+    string vertexSource, fragmentSource;
+    string variant;             // defined after the #version line, empty for none
+    int slot;                   // the shaderSlots entry it replaces, when reloading
+    string driver, cachePath;
+    bool cached;                // loaded from a cached binary, so already linked
+    GpuHandle program, vertexShader, fragmentShader;
+};
+
+/* Define variant in a shader source, keeping the file's line numbers in logs */
+string withVariant(const string& source,const string& variant)
+{
+    size_t version = source.find('\n');
+    if(variant.empty() || version == string::npos)
+        return source;
+    return source.substr(0, version+1) + "#define " + variant + "\n#line 2\n" + source.substr(version+1);
+}
+
+/* How logs name a build */
+string programName(const ProgramBuild& build)
+{
+    string name = build.vertexPath + " + " + build.fragmentPath;
+    if(!build.variant.empty())
+        name += " (" + build.variant + ")";
+    return name;
+}
+
+/* Start building, from the cache when it can be */
+void startProgramBuild(ProgramBuild& build)
+{
+    build.vertexSource = withVariant(build.vertexSource, build.variant);
+    build.fragmentSource = withVariant(build.fragmentSource, build.variant);
+
+    // Key the cache by both sources and the driver that built the binary
+    build.driver = driverString();
+    unsigned long long key = 14695981039346656037ULL;
+    key = hashBytes(key, build.vertexSource.data(), build.vertexSource.size());
+    key = hashBytes(key, "", 1);
+    key = hashBytes(key, build.fragmentSource.data(), build.fragmentSource.size());
+    key = hashBytes(key, build.driver.data(), build.driver.size());
+    char cachePath[64];
+    sprintf(cachePath, SHADER_CACHE_DIR "/%016llx.bin", key);
+    build.cachePath = cachePath;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+    build.program = createProgram();
+    build.cached = formats > 0 && loadProgramBinary(build.program, cachePath, build.driver);
+    if(build.cached)
+        return;
+
+    // No usable binary, so compile. The shaders go once the build does
+    build.vertexShader = createShader(GL_VERTEX_SHADER);
+    const char* text = build.vertexSource.c_str();
+    glShaderSource(build.vertexShader, 1, &text, NULL);
+    glCompileShader(build.vertexShader);
+
+    build.fragmentShader = createShader(GL_FRAGMENT_SHADER);
+    text = build.fragmentSource.c_str();
+    glShaderSource(build.fragmentShader, 1, &text, NULL);
+    glCompileShader(build.fragmentShader);
+
+    if(formats > 0)
+        glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(build.program, build.vertexShader);
+    glAttachShader(build.program, build.fragmentShader);
+    glLinkProgram(build.program);
+}
+
+/* Whether finishing the build would not have to wait on the driver */
+bool programBuildReady(const ProgramBuild& build)
+{
+    if(build.cached || !GLAD_GL_ARB_parallel_shader_compile)
+        return true;
+    GLint done = GL_FALSE;
+    glGetProgramiv(build.program, GL_COMPLETION_STATUS_ARB, &done);
+    return done == GL_TRUE;
+}
+
+/* The linked program, or an empty handle when a stage failed to compile or link */
+GpuHandle finishProgramBuild(ProgramBuild& build)
+{
+    if(build.cached)
+        return build.program;
+
+    // Check both stages so that both logs are printed
+    bool compiled = shaderCompiled(build.vertexShader, build.vertexPath.c_str());
+    compiled = shaderCompiled(build.fragmentShader, build.fragmentPath.c_str()) && compiled;
+    if(!compiled)
+        return GpuHandle();
+    glDetachShader(build.program, build.vertexShader);
+    glDetachShader(build.program, build.fragmentShader);
 
     GLint Result = GL_FALSE;
-    int InfoLogLength;
-
-    // Compile Vertex Shader
-    printf("Compiling shader : %s\n", vertex_file_path);
-    char const * VertexSourcePointer = VertexShaderCode.c_str();
-    glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-    glCompileShader(VertexShaderID);
-
-    // Check Vertex Shader
-    glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-    // Compile Fragment Shader
-    printf("Compiling shader : %s\n", fragment_file_path);
-    char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-    glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-    glCompileShader(FragmentShaderID);
-
-    // Check Fragment Shader
-    glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-    // Link the program
-    fprintf(stdout, "Linking program\n");
-    GLuint ProgramID = glCreateProgram();
-    glAttachShader(ProgramID, VertexShaderID);
-    glAttachShader(ProgramID, FragmentShaderID);
-    glLinkProgram(ProgramID);
-
-    // Check the program
-    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-    glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-    glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-    fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
-    glDeleteShader(VertexShaderID);
-    glDeleteShader(FragmentShaderID);
-
-    return ProgramID;
+    glGetProgramiv(build.program, GL_LINK_STATUS, &Result);
+    string what = programName(build);
+    printInfoLog(build.program, true, what.c_str());
+    if(Result != GL_TRUE)
+    {
+        fprintf(stderr, "Error: could not link %s\n", what.c_str());
+        return GpuHandle();
+    }
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if(formats > 0)
+        saveProgramBinary(build.program, build.cachePath.c_str(), build.driver);
+    return build.program;
+}
+
+/* Load a shader pair into a linked program, from the cache when it can be.
+   variant, when given, is defined in both stages. Returns an empty handle
+   when a stage fails to compile or link */
+GpuHandle LoadShaders(const char * vertex_file_path,const char * fragment_file_path,const char * variant) {
+
+    ProgramBuild build;
+    build.vertexPath = vertex_file_path;
+    build.fragmentPath = fragment_file_path;
+    build.variant = variant ? variant : "";
+    if(!readShaderSource(vertex_file_path, build.vertexSource) || !readShaderSource(fragment_file_path, build.fragmentSource))
+        return GpuHandle();
+    startProgramBuild(build);
+    return finishProgramBuild(build);
+}
+
+/* Look up everything the draw functions need in a linked program */
+ShaderProgram shaderProgramFor(const GpuHandle& linked)
+{
+    ShaderProgram program;
+    program.ProgramID = linked;
+    program.ModelID = glGetUniformLocation(program.ProgramID, "model");
+    program.ObjectPositionID = glGetUniformLocation(program.ProgramID, "objectPosition");
+
+    GLuint blockIndex = glGetUniformBlockIndex(program.ProgramID, "FrameData");
+    if(blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program.ProgramID, blockIndex, FRAME_UNIFORM_BINDING);
+    return program;
+}
+
+/* Load a shader pair and look up everything the draw functions need */
+ShaderProgram createShaderProgram(const char * vertex_file_path,const char * fragment_file_path,const char * variant)
+{
+    GpuHandle linked = LoadShaders(vertex_file_path, fragment_file_path, variant);
+    if(!linked)
+    {
+        ShaderProgram program;
+        program.ModelID = program.ObjectPositionID = -1;
+        return program;
+    }
+    return shaderProgramFor(linked);
+}
+
+/* Every program the game draws with, and the files it is built from */
+struct ShaderSlot {
+    ShaderProgram *program;
+    const char *vertexPath;
+    const char *fragmentPath;
+    const char *variant;        // defined in both stages, NULL for none
+};
+
+ShaderSlot shaderSlots[] = {
+    { &objectPrograms[LIGHT_PLAIN], "TextureRender.vert", "TextureRender.frag", NULL },
+    { &objectPrograms[LIGHT_SPOTLIGHT], "TextureRender.vert", "TextureRender.frag", "SPOTLIGHT" },
+    { &objectPrograms[LIGHT_DIM], "TextureRender.vert", "TextureRender.frag", "DIM" },
+    // Floor, pillars and coins are drawn instanced, one draw call per batch
+    { &instancedPrograms[LIGHT_PLAIN], "Instanced.vert", "TextureRender.frag", NULL },
+    { &instancedPrograms[LIGHT_SPOTLIGHT], "Instanced.vert", "TextureRender.frag", "SPOTLIGHT" },
+    { &instancedPrograms[LIGHT_DIM], "Instanced.vert", "TextureRender.frag", "DIM" },
+};
+#define SHADER_SLOTS (int)(sizeof(shaderSlots)/sizeof(shaderSlots[0]))
+
+/* Shader hot reload. A thread watches the working directory, where the
+   shaders are read from, and reads the sources of every program whose files
+   were written. The game starts those builds at the top of the next frame
+   and swaps each program in once it has linked, before anything is queued
+   with it, so a frame never mixes the two. A failed build keeps the old one */
+#define SHADER_QUEUE_SIZE 16
+
+struct ShaderWatcher {
+    thread worker;
+    atomic<bool> running;
+    int fd;                                 // inotify instance, non-blocking
+    SpscRing<ProgramBuild*,SHADER_QUEUE_SIZE> sources;     // read by the watcher, built by the game
+    ProgramBuild *building[SHADER_SLOTS];   // started and waiting on the driver. Game thread only
+} shaderWatcher;
+
+bool watchShaders;
+
+#ifdef __linux__
+void shaderWatcherThread()
+{
+    // Each event carries the file name, so leave room for several
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(shaderWatcher.running.load(memory_order_acquire))
+    {
+        ssize_t got=read(shaderWatcher.fd, events, sizeof(events));
+        if(got<=0)
+        {
+            this_thread::sleep_for(chrono::milliseconds(50));
+            continue;
+        }
+        bool changed[SHADER_SLOTS]={};
+        for(char *p=events;p<events+got;)
+        {
+            const struct inotify_event *event=(const struct inotify_event*)p;
+            for(int s=0;s<SHADER_SLOTS && event->len;s++)
+            {
+                if(!strcmp(event->name,shaderSlots[s].vertexPath) || !strcmp(event->name,shaderSlots[s].fragmentPath))
+                {
+                    changed[s]=true;
+                }
+            }
+            p+=sizeof(struct inotify_event)+event->len;
+        }
+        for(int s=0;s<SHADER_SLOTS;s++)
+        {
+            if(!changed[s])
+            {
+                continue;
+            }
+            ProgramBuild *build=new ProgramBuild;
+            build->slot=s;
+            build->vertexPath=shaderSlots[s].vertexPath;
+            build->fragmentPath=shaderSlots[s].fragmentPath;
+            build->variant=shaderSlots[s].variant ? shaderSlots[s].variant : "";
+            // Nothing GL has been made yet, so a build the game never sees can go here
+            if(!readShaderSource(shaderSlots[s].vertexPath,build->vertexSource) ||
+               !readShaderSource(shaderSlots[s].fragmentPath,build->fragmentSource) ||
+               !shaderWatcher.sources.push(build))
+            {
+                delete build;
+            }
+        }
+    }
+}
+#endif
+
+void startShaderWatcher()
+{
+#ifdef __linux__
+    // Editors either write the file in place or write a copy and rename it over
+    shaderWatcher.fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(shaderWatcher.fd<0 || inotify_add_watch(shaderWatcher.fd, ".", IN_CLOSE_WRITE|IN_MOVED_TO)<0)
+    {
+        fprintf(stderr, "Error: could not watch the shaders for changes: %s\n", strerror(errno));
+        if(shaderWatcher.fd>=0)
+        {
+            close(shaderWatcher.fd);
+        }
+        return;
+    }
+    shaderWatcher.sources.clear();
+    for(int s=0;s<SHADER_SLOTS;s++)
+    {
+        shaderWatcher.building[s]=NULL;
+    }
+    shaderWatcher.running=true;
+    shaderWatcher.worker=thread(shaderWatcherThread);
+#else
+    fprintf(stderr, "Error: watching shaders needs inotify, which this platform does not have\n");
+#endif
+}
+
+void stopShaderWatcher()
+{
+    if(!shaderWatcher.running)
+    {
+        return;
+    }
+    shaderWatcher.running=false;
+    shaderWatcher.worker.join();
+    close(shaderWatcher.fd);
+    ProgramBuild *build;
+    while(shaderWatcher.sources.pop(build))
+    {
+        delete build;
+    }
+    for(int s=0;s<SHADER_SLOTS;s++)
+    {
+        delete shaderWatcher.building[s];
+        shaderWatcher.building[s]=NULL;
+    }
+}
+
+/* Start the builds the watcher asked for and swap in the ones that are done.
+   Called at the top of draw(), while nothing is queued with the old programs */
+void reloadShaders()
+{
+    if(!shaderWatcher.running)
+    {
+        return;
+    }
+    ProgramBuild *build;
+    while(shaderWatcher.sources.pop(build))
+    {
+        // A newer edit replaces a build still in progress
+        delete shaderWatcher.building[build->slot];
+        shaderWatcher.building[build->slot]=build;
+        startProgramBuild(*build);
+    }
+    for(int s=0;s<SHADER_SLOTS;s++)
+    {
+        build=shaderWatcher.building[s];
+        if(!build || !programBuildReady(*build))
+        {
+            continue;
+        }
+        GpuHandle linked=finishProgramBuild(*build);
+        if(linked)
+        {
+            // The old program is deleted with the rest of the frame's garbage
+            *shaderSlots[s].program=shaderProgramFor(linked);
+            printf("Reloaded %s\n", programName(*build).c_str());
+        }
+        else
+        {
+            fprintf(stderr, "Kept the previous %s\n", programName(*build).c_str());
+        }
+        delete build;
+        shaderWatcher.building[s]=NULL;
+    }
 }
 
 static void error_callback(int error, const char* description)
@@ -131,88 +713,261 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+void stopAudio();
+void stopLevelLoader();
+
+/* Join every worker thread. Every exit() after initGL goes through here, since
+   a thread still joinable when the process exits terminates it */
+void stopThreads()
+{
+    stopAudio();
+    stopLevelLoader();
+    stopShaderWatcher();
+}
+
 void quit(GLFWwindow *window)
 {
+    stopThreads();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+Vertex makeVertex (float x, float y, float z, const GLfloat* rgb, float u, float v, bool highlight=false)
 {
-    struct VAO* vao = new struct VAO;
-    vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
-    vao->FillMode = fill_mode;
+    Vertex vertex;
+    vertex.position[0] = x;
+    vertex.position[1] = y;
+    vertex.position[2] = z;
+    for (int c=0; c<3; c++)
+        vertex.color[c] = (GLubyte)(min(max(rgb[c],0.0f),1.0f)*255.0f+0.5f);
+    vertex.color[3] = highlight ? 255 : 0;
+    vertex.texCoord[0] = (GLushort)(u*65535.0f+0.5f);
+    vertex.texCoord[1] = (GLushort)(v*65535.0f+0.5f);
+    return vertex;
+}
+
+/* Add an indexed shape to the shared mesh buffers and return its handle.
+   Indices count from the shape's first vertex */
+int create3DObject (GLenum primitive_mode, int numVertices, const Vertex* vertices, int numIndices, const GLushort* indices, GLenum fill_mode=GL_FILL)
+{
+    int base = meshes.vertices.size();
+    if (base+numVertices > 0x10000) {
+        fprintf(stderr, "Error: the mesh buffers are full\n");
+        stopThreads();
+        exit(EXIT_FAILURE);
+    }
+    Mesh mesh;
+    mesh.PrimitiveMode = primitive_mode;
+    mesh.FillMode = fill_mode;
+    mesh.FirstIndex = meshes.indices.size();
+    mesh.NumIndices = numIndices;
+    mesh.Radius = 0;
+    for (int i=0; i<numVertices; i++)
+        mesh.Radius = max(mesh.Radius, glm::length(glm::vec3(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2])));
+
+    meshes.vertices.insert(meshes.vertices.end(), vertices, vertices+numVertices);
+    for (int i=0; i<numIndices; i++)
+        meshes.indices.push_back(base+indices[i]);
+    meshes.list.push_back(mesh);
+    meshes.dirty = true;
+    return meshes.list.size()-1;
+}
 
-    // Create Vertex Array Object
-    // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+/* Add a shape given as separate position and colour arrays.
+   Vertices repeated with the same colour are stored once and indexed */
+int create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    vector<Vertex> vertices;
+    vector<GLushort> indices;
+    map<vector<GLfloat>,GLushort> seen;
+    for (int i=0; i<numVertices; i++) {
+        vector<GLfloat> key(vertex_buffer_data+3*i, vertex_buffer_data+3*i+3);
+        key.insert(key.end(), color_buffer_data+3*i, color_buffer_data+3*i+3);
+        map<vector<GLfloat>,GLushort>::iterator it = seen.find(key);
+        if (it == seen.end()) {
+            it = seen.insert(make_pair(key, (GLushort)vertices.size())).first;
+            vertices.push_back(makeVertex(key[0], key[1], key[2], &key[3], 0, 0));
+        }
+        indices.push_back(it->second);
+    }
+    return create3DObject(primitive_mode, vertices.size(), &vertices[0], indices.size(), &indices[0], fill_mode);
+}
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-            0,                  // attribute 0. Vertices
-            3,                  // size (x,y,z)
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-            );
+/* Point attributes 0-2 at the interleaved layout of the bound array buffer */
+void bindVertexLayout ()
+{
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));         // attribute 0. Vertices
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));      // attribute 1. Color
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, texCoord));  // attribute 2. Texture coordinates
+    glEnableVertexAttribArray(2);
+}
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-            1,                  // attribute 1. Color
-            3,                  // size (r,g,b)
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-            );
+/* Handle of a shape some create* helper already made under this name, or -1 */
+int findMesh (const char* name)
+{
+    map<string,int>::iterator it = meshes.byName.find(name);
+    return it == meshes.byName.end() ? -1 : it->second;
+}
 
-    return vao;
+/* Copy the shared mesh buffers to the GPU - call once shapes are added, before drawing them */
+void uploadMeshes ()
+{
+    if (!meshes.dirty)
+        return;
+    if (meshes.VertexArrayID == 0) {
+        // Should be done after CreateWindow and before any other GL calls
+        meshes.VertexArrayID = genVertexArray();
+        meshes.VertexBuffer = genBuffer();
+        meshes.IndexBuffer = genBuffer();
+    }
+    glBindVertexArray (meshes.VertexArrayID);
+    glBindBuffer (GL_ARRAY_BUFFER, meshes.VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, meshes.vertices.size()*sizeof(Vertex), &meshes.vertices[0], GL_STATIC_DRAW);
+    bindVertexLayout();
+
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, meshes.IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, meshes.indices.size()*sizeof(GLushort), &meshes.indices[0], GL_STATIC_DRAW);
+    glBindVertexArray (0);
+    meshes.dirty = false;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Add a shape to the shared mesh buffers - Common Color for all vertices */
+int create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    vector<GLfloat> color_buffer_data (3*numVertices);
     for (int i=0; i<numVertices; i++) {
         color_buffer_data [3*i] = red;
         color_buffer_data [3*i + 1] = green;
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* What the last frame submitted - reset at the start of draw() */
+struct RenderStats {
+    int drawCalls;
+    long triangles;
+    int culled;             // entities left out because the camera can't see them
+    int stateChanges;       // programs, vertex arrays, fill modes and offsets set by the render queue
+} renderStats;
+
+void countDraw (GLenum primitive_mode, int numVertices, int instances)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    renderStats.drawCalls += 1;
+    if (primitive_mode == GL_TRIANGLES)
+        renderStats.triangles += (long)(numVertices/3)*instances;
+}
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+/* Everything a frame draws goes through the render queue. Packets are
+   collected while the frame is built, sorted so that packets sharing a
+   program, vertex array and fill mode sit together, then issued with only
+   the state changes between neighbours */
+struct DrawPacket {
+    unsigned long long key;         // program, vertex array, fill mode, overlay, first index - most significant first
+    const ShaderProgram *program;
+    GLuint vertexArray;
+    GLenum fillMode;
+    bool overlay;                   // pulled towards the camera to win over coplanar geometry
+    GLenum primitiveMode;
+    GLenum indexType;
+    size_t firstByte;
+    int count;
+    int instances;                  // 0 for a single object, placed by model and objectPosition
+    glm::mat4 model;
+    glm::vec3 objectPosition;
+};
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+vector<DrawPacket> renderQueue;
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+void queuePacket (DrawPacket packet)
+{
+    packet.key = (unsigned long long)(packet.program->ProgramID & 0xffff) << 48
+               | (unsigned long long)(packet.vertexArray & 0xffff) << 32
+               | (unsigned long long)(packet.fillMode != GL_FILL) << 31
+               | (unsigned long long)packet.overlay << 30
+               | (packet.firstByte & 0x3fffffff);
+    renderQueue.push_back(packet);
+}
+
+bool packetBefore (const DrawPacket& a, const DrawPacket& b)
+{
+    return a.key < b.key;
+}
+
+/* Sort and issue the frame's packets. What earlier code left bound is not
+   trusted, so the first packet sets everything */
+void flushRenderQueue ()
+{
+    stable_sort(renderQueue.begin(), renderQueue.end(), packetBefore);
+    GLuint program = 0, vertexArray = 0;
+    GLenum fillMode = GL_NONE;
+    bool overlay = false, first = true;
+    for (size_t p = 0; p < renderQueue.size(); p++) {
+        const DrawPacket& packet = renderQueue[p];
+        if (first || packet.program->ProgramID != program) {
+            program = packet.program->ProgramID;
+            glUseProgram(program);
+            renderStats.stateChanges++;
+        }
+        if (first || packet.vertexArray != vertexArray) {
+            vertexArray = packet.vertexArray;
+            glBindVertexArray(vertexArray);
+            renderStats.stateChanges++;
+        }
+        if (first || packet.fillMode != fillMode) {
+            fillMode = packet.fillMode;
+            glPolygonMode(GL_FRONT_AND_BACK, fillMode);
+            renderStats.stateChanges++;
+        }
+        if (packet.overlay != overlay) {
+            overlay = packet.overlay;
+            if (overlay) {
+                glEnable(GL_POLYGON_OFFSET_FILL);
+                glPolygonOffset(-1.0f, -1.0f);
+            }
+            else
+                glDisable(GL_POLYGON_OFFSET_FILL);
+            renderStats.stateChanges++;
+        }
+        first = false;
+
+        if (packet.instances == 0) {
+            glUniformMatrix4fv(packet.program->ModelID, 1, GL_FALSE, &packet.model[0][0]);
+            glUniform3f(packet.program->ObjectPositionID, packet.objectPosition[0], packet.objectPosition[1], packet.objectPosition[2]);
+            glDrawElements(packet.primitiveMode, packet.count, packet.indexType, (void*)packet.firstByte);
+        }
+        else
+            glDrawElementsInstanced(packet.primitiveMode, packet.count, packet.indexType, (void*)packet.firstByte, packet.instances);
+        countDraw(packet.primitiveMode, packet.count, max(packet.instances, 1));
+    }
+    if (overlay)
+        glDisable(GL_POLYGON_OFFSET_FILL);
+    renderQueue.clear();
+}
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Queue one shape from the shared mesh buffers, drawn with the object program */
+void draw3DObject (int handle, const glm::mat4& model, glm::vec3 objectPosition)
+{
+    const Mesh& mesh = meshes.list[handle];
+    DrawPacket packet;
+    packet.program = &objectPrograms[frameLighting];
+    // Every shape shares one VAO, with the vertex and index buffers bound
+    packet.vertexArray = meshes.VertexArrayID;
+    packet.fillMode = mesh.FillMode;
+    packet.overlay = false;
+    packet.primitiveMode = mesh.PrimitiveMode;
+    packet.indexType = GL_UNSIGNED_SHORT;
+    packet.firstByte = mesh.FirstIndex*sizeof(GLushort);
+    packet.count = mesh.NumIndices;
+    packet.instances = 0;
+    packet.model = model;
+    packet.objectPosition = objectPosition;
+    queuePacket(packet);
 }
 
 /**************************
@@ -227,66 +982,411 @@ float movePlayerLeft=0.0f,movePlayerRight=0.0f;
 bool leftFlag=false,rightFlag=false;
 bool upFlag=false,downFlag=false,zoomFlag=false;
 bool heroFlag=false,zoom1Flag=false,jumpFlag=false;
-float camAngle=0;
 bool fall=false,topFlag=false,followFlag=false,headCamFlag=false;
 
 
-void *play_audio(string audioFile)
-{
-    mpg123_handle *mh;
-    unsigned char *buffer;
-    size_t buffer_size;
-    size_t done;
-    int err;
+/* Audio engine : one thread owns the output device and mixes every sound in software */
 
-    int driver;
-    ao_device *dev;
+#define AUDIO_RATE 44100
+#define AUDIO_CHANNELS 2
+#define AUDIO_MIX_FRAMES 1024       // frames per block written to the sink, about 23 ms
+#define AUDIO_MAX_VOICES 16
+#define AUDIO_QUEUE_SIZE 64         // power of two
+#define AUDIO_DECODE_SAMPLES 8192   // chunk size for streamed tracks
+#define AUDIO_CACHE_SECONDS 10      // longer sounds are streamed even if asked to be cached
 
-    ao_sample_format format;
-    int channels, encoding;
-    long rate;
+struct AudioCommand {
+    char file[256];
+    chrono::steady_clock::time_point queued;
+};
 
-    /* initializations */
-    ao_initialize();
-    driver = ao_default_driver_id();
-    mpg123_init();
-    mh = mpg123_new(NULL, &err);
-    buffer_size = mpg123_outblock(mh);
-    buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
-
-    /* open the file and get the decoding format */
-    mpg123_open(mh, &audioFile[0]);
-    mpg123_getformat(mh, &rate, &channels, &encoding);
-
-    /* set the output format and open the output device */
-    format.bits = mpg123_encsize(encoding) * 8;
-    format.rate = rate;
-    format.channels = channels;
-    format.byte_format = AO_FMT_NATIVE;
-    format.matrix = 0;
-    dev = ao_open_live(driver, &format, NULL);
-
-    /* decode and play */
-    char *p =(char *)buffer;
-    while (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
-        ao_play(dev, p, done);
-
-    /* clean up */
-    free(buffer);
-    ao_close(dev);
-    mpg123_close(mh);
-    mpg123_delete(mh);
+/* Where the mixed blocks go. Only libao needs a sound device */
+enum AudioSinkType { AUDIO_SINK_NONE, AUDIO_SINK_LIBAO, AUDIO_SINK_NULL, AUDIO_SINK_WAV };
+
+struct AudioSink {
+    AudioSinkType type;
+    const char* path;                   // output file of the WAV sink
+    ao_device *device;
+    FILE *file;
+    unsigned long dataBytes;
+    chrono::steady_clock::time_point deadline;
+};
+
+/* Filled in by the audio thread, read once it has been joined */
+struct AudioStats {
+    long blocks;
+    double mixMs,mixMaxMs;
+    long triggers;
+    double latencyMs,latencyMaxMs;
+};
+
+/* A short effect decoded once into memory, in the mixer's rate */
+struct AudioAsset {
+    int channels;
+    vector<short> pcm;
+};
+
+/* One sound being played, either read from an asset or decoded a chunk at a time */
+struct Voice {
+    bool active;
+    const AudioAsset *asset;
+    mpg123_handle *decoder;
+    int channels;
+    short pcm[AUDIO_DECODE_SAMPLES];
+    size_t samples,pos;
+};
+
+struct AudioEngine {
+    thread worker;
+    atomic<bool> running;
+    AudioSink sink;
+    AudioStats stats;
+    SpscRing<AudioCommand,AUDIO_QUEUE_SIZE> queue;     // pushed by the game, popped by the audio thread
+    Voice voices[AUDIO_MAX_VOICES];
+    vector<string> preload;             // set before startAudio, read by the audio thread
+    map<string,AudioAsset> cache;       // owned by the audio thread
+} audio;
+
+mpg123_handle* openDecoder(const char* file,int& channels)
+{
+    int err;
+    long rate;
+    int encoding;
+    mpg123_handle *decoder=mpg123_new(NULL, &err);
+    if(!decoder)
+    {
+        return NULL;
+    }
+    // Ask for what the mixer wants, mpg123 converts the rate if it has to
+    mpg123_format_none(decoder);
+    mpg123_format(decoder, AUDIO_RATE, MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16);
+    if(mpg123_open(decoder, file)!=MPG123_OK || mpg123_getformat(decoder, &rate, &channels, &encoding)!=MPG123_OK)
+    {
+        fprintf(stderr, "Error: could not decode %s\n", file);
+        mpg123_close(decoder);
+        mpg123_delete(decoder);
+        return NULL;
+    }
+    return decoder;
 }
 
-int timer=0;
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Decode a whole file into the cache, so playing it later is only a buffer read */
+void cacheSound(const string& file)
 {
-    // Function is called first on GLFW_PRESS.
+    int channels;
+    mpg123_handle *decoder=openDecoder(file.c_str(),channels);
+    if(!decoder)
+    {
+        return;
+    }
+    AudioAsset asset;
+    asset.channels=channels;
+    size_t limit=(size_t)AUDIO_CACHE_SECONDS*AUDIO_RATE*channels;
+    short chunk[AUDIO_DECODE_SAMPLES];
+    size_t done=0;
+    int status;
+    do
+    {
+        status=mpg123_read(decoder, (unsigned char*)chunk, sizeof(chunk), &done);
+        asset.pcm.insert(asset.pcm.end(), chunk, chunk+done/sizeof(short));
+    } while((status==MPG123_OK || status==MPG123_NEW_FORMAT) && asset.pcm.size()<=limit);
+    mpg123_close(decoder);
+    mpg123_delete(decoder);
 
-    if (action == GLFW_RELEASE) {
-        switch (key) {
+    if(asset.pcm.size()>limit)
+    {
+        fprintf(stderr, "Warning: %s is too long to cache, it will be streamed\n", file.c_str());
+        return;
+    }
+    audio.cache[file].channels=asset.channels;
+    audio.cache[file].pcm.swap(asset.pcm);
+}
+
+void stopVoice(Voice& voice)
+{
+    if(voice.decoder)
+    {
+        mpg123_close(voice.decoder);
+        mpg123_delete(voice.decoder);
+    }
+    voice.decoder=NULL;
+    voice.asset=NULL;
+    voice.active=false;
+}
+
+void startVoice(const char* file)
+{
+    // With every voice busy the sound in slot 0 gives way
+    int slot=0;
+    for(int i=0;i<AUDIO_MAX_VOICES;i++)
+    {
+        if(!audio.voices[i].active)
+        {
+            slot=i;
+            break;
+        }
+    }
+    Voice& voice=audio.voices[slot];
+    stopVoice(voice);
+
+    map<string,AudioAsset>::const_iterator cached=audio.cache.find(file);
+    if(cached!=audio.cache.end())
+    {
+        voice.asset=&cached->second;
+        voice.channels=voice.asset->channels;
+    }
+    else
+    {
+        voice.decoder=openDecoder(file,voice.channels);
+        if(!voice.decoder)
+        {
+            return;
+        }
+    }
+    voice.samples=voice.pos=0;
+    voice.active=true;
+}
+
+/* Next stereo frame of a voice, false once it has finished */
+bool nextFrame(Voice& voice,int& left,int& right)
+{
+    if(voice.asset)
+    {
+        const vector<short>& pcm=voice.asset->pcm;
+        if(voice.pos+voice.channels>pcm.size())
+        {
+            return false;
+        }
+        left=pcm[voice.pos];
+        right=pcm[voice.pos+voice.channels-1];
+        voice.pos+=voice.channels;
+        return true;
+    }
+
+    if(voice.pos+voice.channels>voice.samples)
+    {
+        size_t done=0;
+        int status=mpg123_read(voice.decoder, (unsigned char*)voice.pcm, sizeof(voice.pcm), &done);
+        voice.samples=done/sizeof(short);
+        voice.pos=0;
+        if(voice.samples<(size_t)voice.channels || (status!=MPG123_OK && status!=MPG123_NEW_FORMAT && status!=MPG123_DONE))
+        {
+            return false;
+        }
+    }
+    left=voice.pcm[voice.pos];
+    right=voice.pcm[voice.pos+voice.channels-1];
+    voice.pos+=voice.channels;
+    return true;
+}
+
+void writeLE(FILE* file,unsigned long value,int bytes)
+{
+    for(int i=0;i<bytes;i++)
+    {
+        fputc((value>>(8*i))&0xff, file);
+    }
+}
+
+/* RIFF header of a 16-bit PCM file; the sizes are patched in closeSink */
+void writeWavHeader(FILE* file,unsigned long dataBytes)
+{
+    fwrite("RIFF", 1, 4, file);
+    writeLE(file, 36+dataBytes, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    writeLE(file, 16, 4);
+    writeLE(file, 1, 2);
+    writeLE(file, AUDIO_CHANNELS, 2);
+    writeLE(file, AUDIO_RATE, 4);
+    writeLE(file, AUDIO_RATE*AUDIO_CHANNELS*sizeof(short), 4);
+    writeLE(file, AUDIO_CHANNELS*sizeof(short), 2);
+    writeLE(file, 16, 2);
+    fwrite("data", 1, 4, file);
+    writeLE(file, dataBytes, 4);
+}
+
+bool openSink(AudioSink& sink)
+{
+    sink.device=NULL;
+    sink.file=NULL;
+    sink.dataBytes=0;
+    sink.deadline=chrono::steady_clock::now();
+    if(sink.type==AUDIO_SINK_LIBAO)
+    {
+        ao_sample_format format;
+        memset(&format, 0, sizeof(format));
+        format.bits = 16;
+        format.rate = AUDIO_RATE;
+        format.channels = AUDIO_CHANNELS;
+        format.byte_format = AO_FMT_NATIVE;
+        format.matrix = 0;
+        sink.device = ao_open_live(ao_default_driver_id(), &format, NULL);
+        if(!sink.device)
+        {
+            fprintf(stderr, "Error: could not open the audio device, playing without sound\n");
+            return false;
+        }
+    }
+    else if(sink.type==AUDIO_SINK_WAV)
+    {
+        sink.file=fopen(sink.path, "wb");
+        if(!sink.file)
+        {
+            fprintf(stderr, "Error: could not write %s, playing without sound\n", sink.path);
+            return false;
+        }
+        writeWavHeader(sink.file, 0);
+    }
+    return sink.type!=AUDIO_SINK_NONE;
+}
+
+void writeSink(AudioSink& sink,short* samples,unsigned long bytes)
+{
+    if(sink.type==AUDIO_SINK_LIBAO)
+    {
+        // Blocks until the device wants more, which paces the audio thread
+        ao_play(sink.device, (char*)samples, bytes);
+        return;
+    }
+    if(sink.type==AUDIO_SINK_WAV)
+    {
+        fwrite(samples, 1, bytes, sink.file);
+        sink.dataBytes+=bytes;
+    }
+    // Without a device keep to real time ourselves, so sounds line up with the game
+    sink.deadline+=chrono::microseconds(1000000LL*AUDIO_MIX_FRAMES/AUDIO_RATE);
+    this_thread::sleep_until(sink.deadline);
+}
+
+void closeSink(AudioSink& sink)
+{
+    if(sink.device)
+    {
+        ao_close(sink.device);
+    }
+    if(sink.file)
+    {
+        rewind(sink.file);
+        writeWavHeader(sink.file, sink.dataBytes);
+        fclose(sink.file);
+    }
+    sink.device=NULL;
+    sink.file=NULL;
+}
+
+void audioThread()
+{
+    ao_initialize();
+    mpg123_init();
+    for(size_t i=0;i<audio.preload.size();i++)
+    {
+        if(!audio.cache.count(audio.preload[i]))
+        {
+            cacheSound(audio.preload[i]);
+        }
+    }
+    bool open=openSink(audio.sink);
+
+    static short mix[AUDIO_MIX_FRAMES*AUDIO_CHANNELS];
+    AudioCommand command;
+    while(open && audio.running.load(memory_order_acquire))
+    {
+        chrono::steady_clock::time_point start=chrono::steady_clock::now();
+        while(audio.queue.pop(command))
+        {
+            startVoice(command.file);
+            double latency=chrono::duration<double, milli>(chrono::steady_clock::now()-command.queued).count();
+            audio.stats.triggers++;
+            audio.stats.latencyMs+=latency;
+            audio.stats.latencyMaxMs=max(audio.stats.latencyMaxMs,latency);
+        }
+
+        for(int f=0;f<AUDIO_MIX_FRAMES;f++)
+        {
+            int left=0,right=0;
+            for(int v=0;v<AUDIO_MAX_VOICES;v++)
+            {
+                Voice& voice=audio.voices[v];
+                int l,r;
+                if(!voice.active)
+                {
+                    continue;
+                }
+                if(!nextFrame(voice,l,r))
+                {
+                    stopVoice(voice);
+                    continue;
+                }
+                left+=l;
+                right+=r;
+            }
+            mix[2*f]=max(-32768,min(32767,left));
+            mix[2*f+1]=max(-32768,min(32767,right));
+        }
+        double mixTime=chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+        audio.stats.blocks++;
+        audio.stats.mixMs+=mixTime;
+        audio.stats.mixMaxMs=max(audio.stats.mixMaxMs,mixTime);
+
+        writeSink(audio.sink, mix, sizeof(mix));
+    }
+
+    for(int v=0;v<AUDIO_MAX_VOICES;v++)
+    {
+        stopVoice(audio.voices[v]);
+    }
+    closeSink(audio.sink);
+    mpg123_exit();
+    ao_shutdown();
+}
+
+void startAudio()
+{
+    audio.queue.clear();
+    memset(&audio.stats, 0, sizeof(audio.stats));
+    for(int v=0;v<AUDIO_MAX_VOICES;v++)
+    {
+        audio.voices[v].active=false;
+        audio.voices[v].asset=NULL;
+        audio.voices[v].decoder=NULL;
+    }
+    audio.running=true;
+    audio.worker=thread(audioThread);
+}
+
+void stopAudio()
+{
+    if(!audio.running)
+    {
+        return;
+    }
+    audio.running=false;
+    audio.worker.join();
+}
+
+/* Queue a sound for the audio thread - never blocks the game */
+void playSound(const char* file)
+{
+    if(!audio.running)
+    {
+        return;
+    }
+    AudioCommand command;
+    strncpy(command.file, file, sizeof(command.file)-1);
+    command.file[sizeof(command.file)-1]='\0';
+    command.queued=chrono::steady_clock::now();
+    audio.queue.push(command);
+}
+
+int timer=0;
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    // Function is called first on GLFW_PRESS.
+
+    if (action == GLFW_RELEASE) {
+        switch (key) {
             case GLFW_KEY_C:
                 rectangle_rot_status = !rectangle_rot_status;
                 break;
@@ -426,7 +1526,8 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
        is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if (window)
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
     GLfloat fov = 0.7f;
 
@@ -459,18 +1560,147 @@ float D2R(float A)
     return (A*PI)/180.0f;
 }
 
-glm::vec3 trans[1000];
-float rotat[1000];
-VAO* objects[1000];
-VAO *triangle,*rectangle,*cube,*pyramid;
-int platform1[11][12];
-int platform2[11][12];
-int platform3[11][12];
-int platform4[11][12];
-int platform5[11][12];
-int platform6[11][12];
-int platform7[11][12];
-int platform8[11][12];
+/* Handle to an entity. Stays valid while other entities come and go,
+   a destroyed entity's handle is recognised by its generation */
+struct Entity {
+    int id;
+    int generation;
+};
+
+const Entity noEntity = { -1, 0 };
+
+// Entity flags
+#define ENTITY_HIDDEN      1    // not drawn (collected coins)
+#define ENTITY_INSTANCED   2    // drawn by its instance batch
+#define ENTITY_HIGHLIGHT   4    // tile under the hero
+#define ENTITY_HERO_PART   8    // turns with the hero about its centre
+#define ENTITY_LIMB        16   // swings about X instead of turning about Y
+#define ENTITY_COIN        32
+#define ENTITY_MERGED      64   // floor tile drawn by its level's floor mesh unless highlighted
+
+/* Scene state as parallel arrays, one entry per live entity, kept dense so the
+   per-frame loops stream through memory. Slots move when an entity is destroyed,
+   handles do not */
+struct EntityStore {
+    vector<glm::vec3> position;
+    vector<float> rotation;
+    // Transforms at the previous simulation step and the blend of both that gets drawn
+    vector<glm::vec3> prevPosition,drawPosition;
+    vector<float> prevRotation,drawRotation;
+    vector<int> mesh;
+    vector<unsigned char> flags;
+    vector<int> level;          // level the entity belongs to, 0 for none
+    vector<int> batch;          // instance batch, -1 if drawn on its own
+    vector<int> owner;          // handle id of each slot
+
+    vector<int> slot;           // by handle id, -1 once destroyed
+    vector<int> generation;     // by handle id
+    vector<int> freeIds;
+} scene;
+
+int entityCount()
+{
+    return scene.mesh.size();
+}
+
+Entity createEntity(int mesh,glm::vec3 position,int flags,int level)
+{
+    Entity entity;
+    if(!scene.freeIds.empty())
+    {
+        entity.id=scene.freeIds.back();
+        scene.freeIds.pop_back();
+    }
+    else
+    {
+        entity.id=scene.slot.size();
+        scene.slot.pb(-1);
+        scene.generation.pb(0);
+    }
+    entity.generation=scene.generation[entity.id];
+    scene.slot[entity.id]=entityCount();
+
+    scene.position.pb(position);
+    scene.rotation.pb(0.0f);
+    scene.prevPosition.pb(position);
+    scene.drawPosition.pb(position);
+    scene.prevRotation.pb(0.0f);
+    scene.drawRotation.pb(0.0f);
+    scene.mesh.pb(mesh);
+    scene.flags.pb(flags);
+    scene.level.pb(level);
+    scene.batch.pb(-1);
+    scene.owner.pb(entity.id);
+    return entity;
+}
+
+/* Slot of a live entity, -1 for a destroyed one */
+int slotOf(Entity entity)
+{
+    if(entity.id<0 || entity.id>=(int)scene.slot.size() || scene.generation[entity.id]!=entity.generation)
+    {
+        return -1;
+    }
+    return scene.slot[entity.id];
+}
+
+/* Remove an entity by moving the last one into its slot */
+void destroyEntity(Entity entity)
+{
+    int i=slotOf(entity);
+    if(i==-1)
+    {
+        return;
+    }
+    int last=entityCount()-1;
+    scene.position[i]=scene.position[last];
+    scene.rotation[i]=scene.rotation[last];
+    scene.prevPosition[i]=scene.prevPosition[last];
+    scene.drawPosition[i]=scene.drawPosition[last];
+    scene.prevRotation[i]=scene.prevRotation[last];
+    scene.drawRotation[i]=scene.drawRotation[last];
+    scene.mesh[i]=scene.mesh[last];
+    scene.flags[i]=scene.flags[last];
+    scene.level[i]=scene.level[last];
+    scene.batch[i]=scene.batch[last];
+    scene.owner[i]=scene.owner[last];
+    scene.slot[scene.owner[i]]=i;
+
+    scene.position.pop_back();
+    scene.rotation.pop_back();
+    scene.prevPosition.pop_back();
+    scene.drawPosition.pop_back();
+    scene.prevRotation.pop_back();
+    scene.drawRotation.pop_back();
+    scene.mesh.pop_back();
+    scene.flags.pop_back();
+    scene.level.pop_back();
+    scene.batch.pop_back();
+    scene.owner.pop_back();
+
+    scene.slot[entity.id]=-1;
+    scene.generation[entity.id]+=1;
+    scene.freeIds.pb(entity.id);
+}
+
+/* Handle of the entity in a slot */
+Entity entityAt(int i)
+{
+    Entity entity={ scene.owner[i], scene.generation[scene.owner[i]] };
+    return entity;
+}
+
+glm::vec3& positionOf(Entity entity)
+{
+    return scene.position[slotOf(entity)];
+}
+
+float& rotationOf(Entity entity)
+{
+    return scene.rotation[slotOf(entity)];
+}
+
+int triangle,rectangle,cube;
 
 // Creates the triangle object used in this sample code
 void createTriangle ()
@@ -490,7 +1720,7 @@ void createTriangle ()
         0,0,1, // color 2
     };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
+    // create3DObject adds the shape to the shared buffers and returns its handle
     triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
 }
 
@@ -518,660 +1748,1850 @@ void createRectangle ()
         1,0,0  // color 1
     };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
+    // create3DObject adds the shape to the shared buffers and returns its handle
     rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
 
-VAO *createPyramid(float length,float height)
-{
-    GLfloat vertex_buffer_data[]={
-        -length,0,length,
-        -length,0,-length,
-        length,0,length,
-        length,0,length,
-        length,0,-length,
-        -length,0,-length,
-        -length,0,length,
-        -length,0,-length,
-        0,height,0,
-        -length,0,length,
-        length,0,length,
-        0,height,0,
-        length,0,length,
-        length,0,-length,
-        0,height,0,
-        length,0,-length,
-        -length,0,-length,
-        0,height,0
-    };
-    GLfloat color_buffer_data [] = {
-        1,0,0, // color 1
-        0,0,1, // color 2
-        0,1,0, // color 3
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0,  // color 1
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0,  // color 1
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0,  // color 1
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0,  // color 1
-
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0,  // color 1
+/* Corners of the six faces of a box as signs of x,y,z, counter-clockwise seen
+   from outside: -x, +x, -y, +y, -z, +z */
+const signed char boxFaces[6][4][3]={
+    { {-1,-1,-1}, {-1,-1, 1}, {-1, 1, 1}, {-1, 1,-1} },
+    { { 1,-1, 1}, { 1,-1,-1}, { 1, 1,-1}, { 1, 1, 1} },
+    { {-1,-1,-1}, { 1,-1,-1}, { 1,-1, 1}, {-1,-1, 1} },
+    { {-1, 1, 1}, { 1, 1, 1}, { 1, 1,-1}, {-1, 1,-1} },
+    { { 1,-1,-1}, {-1,-1,-1}, {-1, 1,-1}, { 1, 1,-1} },
+    { {-1,-1, 1}, { 1,-1, 1}, { 1, 1, 1}, {-1, 1, 1} }
+};
+#define BOX_BOTTOM 2
+#define BOX_TOP 3
 
-        0,1,0, // color 3
-        0.3,0.3,0.3, // color 4
-        1,0,0  // color 1
-    };
-    pyramid = create3DObject(GL_TRIANGLES, 18, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* A box of half sizes sx,sy,sz: 24 vertices, four per face so each face has
+   its own texture coordinates, and 36 indices. colors holds one colour per vertex */
+int createBox(const char* name,float sx,float sy,float sz,const GLfloat colors[24][3],bool highlightTop)
+{
+    const float u[4]={ 0,1,1,0 },v[4]={ 0,0,1,1 };
+    Vertex vertices[24];
+    GLushort indices[36];
+    for(int f=0;f<6;f++)
+    {
+        for(int c=0;c<4;c++)
+        {
+            const signed char *corner=boxFaces[f][c];
+            vertices[4*f+c]=makeVertex(sx*corner[0],sy*corner[1],sz*corner[2],colors[4*f+c],u[c],v[c],highlightTop && f==BOX_TOP);
+        }
+        const GLushort quad[6]={ 0,1,2, 0,2,3 };
+        for(int k=0;k<6;k++)
+        {
+            indices[6*f+k]=4*f+quad[k];
+        }
+    }
+    return meshes.byName[name]=create3DObject(GL_TRIANGLES, 24, vertices, 36, indices, GL_FILL);
 }
 
-VAO* createCube(float side,float colour1,float colour2,float colour3)
+int createPyramid(float length,float height)
 {
-    // GL3 accepts only Triangles. Quads are not supported
-    GLfloat vertex_buffer_data [] = {
-        -side,-side,-side, // triangle 1 : begin
-        -side,-side, side,
-        -side, side, side, // triangle 1 : end
-        side, side,-side, // triangle 2 : begin
-        -side,-side,-side,
-        -side, side,-side,//triangle 2 end
-        side,-side, side,
-        -side,-side,-side,
-        side,-side,-side,
-        side, side,-side,
-        side,-side,-side,
-        -side,-side,-side,
-        -side,-side,-side,
-        -side, side, side,
-        -side, side,-side,
-        side,-side, side,
-        -side,-side, side,
-        -side,-side,-side,
-        -side, side, side,
-        -side,-side, side,
-        side,-side, side,
-        side, side, side,
-        side,-side,-side,
-        side, side,-side,
-        side,-side,-side,
-        side, side, side,
-        side,-side, side,
-        side, side, side,
-        side, side,-side,
-        -side, side,-side,
-        side, side, side,
-        -side, side,-side,
-        -side, side, side,
-        side, side, side,
-        -side, side, side,
-        side,-side, side
-    };
+    char name[64];
+    snprintf(name, sizeof(name), "pyramid %g %g", length, height);
+    int mesh=findMesh(name);
+    if(mesh!=-1)
+    {
+        return mesh;
+    }
+    const GLfloat red[3]={ 1,0,0 },blue[3]={ 0,0,1 },green[3]={ 0,1,0 },grey[3]={ 0.3,0.3,0.3 };
+    Vertex vertices[16];
+    //Base, seen from below
+    vertices[0]=makeVertex(-length,0,-length,red,0,0);
+    vertices[1]=makeVertex(length,0,-length,blue,1,0);
+    vertices[2]=makeVertex(length,0,length,green,1,1);
+    vertices[3]=makeVertex(-length,0,length,grey,0,1);
+    //Sides, each its own triangle up to the apex
+    const float corners[5][2]={ {-length,length}, {length,length}, {length,-length}, {-length,-length}, {-length,length} };
+    for(int side=0;side<4;side++)
+    {
+        vertices[4+3*side]=makeVertex(corners[side][0],0,corners[side][1],green,0,0);
+        vertices[5+3*side]=makeVertex(corners[side+1][0],0,corners[side+1][1],grey,1,0);
+        vertices[6+3*side]=makeVertex(0,height,0,red,0.5,1);
+    }
+    const GLushort indices[18]={ 0,1,2, 0,2,3, 4,5,6, 7,8,9, 10,11,12, 13,14,15 };
+    return meshes.byName[name]=create3DObject(GL_TRIANGLES, 16, vertices, 18, indices, GL_FILL);
+}
 
-    GLfloat color_buffer_data [] = {
-        //Lite
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Back right triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Lite
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Back left triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Left face right triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Front face right triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        //Front face left triangle    
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-
-        //Right face left triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-
-        //Right face right triangle 
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-
-        //Top face right triangle
-        colour1,colour2,colour3,
-        colour1,colour2,colour3,
-        colour1,colour2,colour3,
-
-        //Top face left triangle
-        colour1,colour2,colour3,
-        colour1,colour2,colour3,
-        colour1,colour2,colour3,
-
-        //Front side right triangle
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
-        1.0f,102.0/255.0f,0.0f,
+int createCube(float side,float colour1,float colour2,float colour3)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "cube %g %g %g %g", side, colour1, colour2, colour3);
+    int mesh=findMesh(name);
+    if(mesh!=-1)
+    {
+        return mesh;
+    }
+    //Orange sides, the top in the colour asked for
+    GLfloat colors[24][3];
+    for(int i=0;i<24;i++)
+    {
+        bool top=i/4==BOX_TOP;
+        colors[i][0]=top ? colour1 : 1.0f;
+        colors[i][1]=top ? colour2 : 102.0/255.0f;
+        colors[i][2]=top ? colour3 : 0.0f;
+    }
+    // The top is what the highlight under the hero recolours
+    return createBox(name,side,side,side,colors,true);
+}
 
+int createCuboid(float side1,float side2,float side3)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "cuboid %g %g %g", side1, side2, side3);
+    int mesh=findMesh(name);
+    if(mesh!=-1)
+    {
+        return mesh;
+    }
+    const GLfloat colors[24][3]={
+        { 0.583f,  0.771f,  0.014f },
+        { 0.609f,  0.115f,  0.436f },
+        { 0.327f,  0.483f,  0.844f },
+        { 0.822f,  0.569f,  0.201f },
+        { 0.435f,  0.602f,  0.223f },
+        { 0.310f,  0.747f,  0.185f },
+
+        { 0.597f,  0.770f,  0.761f },
+        { 0.559f,  0.436f,  0.730f },
+        { 0.359f,  0.583f,  0.152f },
+        { 0.483f,  0.596f,  0.789f },
+        { 0.559f,  0.861f,  0.639f },
+        { 0.195f,  0.548f,  0.859f },
+
+        { 0.014f,  0.184f,  0.576f },
+        { 0.771f,  0.328f,  0.970f },
+        { 0.406f,  0.615f,  0.116f },
+        { 0.676f,  0.977f,  0.133f },
+        { 0.971f,  0.572f,  0.833f },
+        { 0.140f,  0.616f,  0.489f },
+
+        { 0.997f,  0.513f,  0.064f },
+        { 0.945f,  0.719f,  0.592f },
+        { 0.543f,  0.021f,  0.978f },
+        { 0.279f,  0.317f,  0.505f },
+        { 0.167f,  0.620f,  0.077f },
+        { 0.347f,  0.857f,  0.137f }
     };
-
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    return create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    return createBox(name,side1,side2,side3,colors,false);
 }
 
+Entity heroEntity,rightHandEntity,leftHandEntity;
+float x=0,y=0,z=0;
+float varang=0,prevVarang=0,drawVarang=0;
 
-VAO* createCuboid(float side1,float side2,float side3)
-{
-    // GL3 accepts only Triangles. Quads are not supported
-    GLfloat vertex_buffer_data [] = {
-        -side1,-side2,-side3, // triangle 1 : begin
-        -side1,-side2, side3,
-        -side1, side2, side3, // triangle 1 : end
-        side1, side2,-side3, // triangle 2 : begin
-        -side1,-side2,-side3,
-        -side1, side2,-side3,//triangle 2 end
-        side1,-side2, side3,
-        -side1,-side2,-side3,
-        side1,-side2,-side3,
-        side1, side2,-side3,
-        side1,-side2,-side3,
-        -side1,-side2,-side3,
-        -side1,-side2,-side3,
-        -side1, side2, side3,
-        -side1, side2,-side3,
-        side1,-side2, side3,
-        -side1,-side2, side3,
-        -side1,-side2,-side3,
-        -side1, side2, side3,
-        -side1,-side2, side3,
-        side1,-side2, side3,
-        side1, side2, side3,
-        side1,-side2,-side3,
-        side1, side2,-side3,
-        side1,-side2,-side3,
-        side1, side2, side3,
-        side1,-side2, side3,
-        side1, side2, side3,
-        side1, side2,-side3,
-        -side1, side2,-side3,
-        side1, side2, side3,
-        -side1, side2,-side3,
-        -side1, side2, side3,
-        side1, side2, side3,
-        -side1, side2, side3,
-        side1,-side2, side3
-    };
+enum CameraMode { CAMERA_HELICOPTER, CAMERA_TOWER, CAMERA_FOLLOW, CAMERA_HEAD };
 
-    GLfloat color_buffer_data [] = {
-        0.583f,  0.771f,  0.014f,
-        0.609f,  0.115f,  0.436f,
-        0.327f,  0.483f,  0.844f,
-        0.822f,  0.569f,  0.201f,
-        0.435f,  0.602f,  0.223f,
-        0.310f,  0.747f,  0.185f,
-
-        0.597f,  0.770f,  0.761f,
-        0.559f,  0.436f,  0.730f,
-        0.359f,  0.583f,  0.152f,
-        0.483f,  0.596f,  0.789f,
-        0.559f,  0.861f,  0.639f,
-        0.195f,  0.548f,  0.859f,
-
-        0.014f,  0.184f,  0.576f,
-        0.771f,  0.328f,  0.970f,
-        0.406f,  0.615f,  0.116f,
-        0.676f,  0.977f,  0.133f,
-        0.971f,  0.572f,  0.833f,
-        0.140f,  0.616f,  0.489f,
-
-        0.997f,  0.513f,  0.064f,
-        0.945f,  0.719f,  0.592f,
-        0.543f,  0.021f,  0.978f,
-        0.279f,  0.317f,  0.505f,
-        0.167f,  0.620f,  0.077f,
-        0.347f,  0.857f,  0.137f,
-
-        0.055f,  0.953f,  0.042f,
-        0.714f,  0.505f,  0.345f,
-        0.783f,  0.290f,  0.734f,
-        0.722f,  0.645f,  0.174f,
-        0.302f,  0.455f,  0.848f,
-        0.225f,  0.587f,  0.040f,
-
-        0.517f,  0.713f,  0.338f,
-        0.053f,  0.959f,  0.120f,
-        0.393f,  0.621f,  0.362f,
-        0.673f,  0.211f,  0.457f,
-        0.820f,  0.883f,  0.371f,
-        0.982f,  0.099f,  0.879f
+// Orbit speed of the helicopter camera while Z/X is held, in degrees per second
+#define CAMERA_ORBIT_SPEED 135.0f
 
-    };
+/* The one camera of the scene, evaluated once per frame */
+struct Camera {
+    CameraMode mode;
+    float angle;            // orbit angle in degrees
+    glm::vec3 eye,target;
+    glm::mat4 view;
+    glm::vec4 frustum[6];   // left, right, bottom, top, near, far planes - inside is dot(plane,(p,1))>=0
+} camera = { CAMERA_HELICOPTER, 0.0f };
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    return create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+// Per entity, in store order: nonzero if it may be on screen this frame
+vector<unsigned char> entityVisible;
+vector<float> cullRadius;
 
-int heroIndex,rightHandIndex,leftHandIndex;
-float x=trans[heroIndex][0];
-float y=trans[heroIndex][1];
-float z=trans[heroIndex][2];
-float varang=0;
+/* Decide once per frame which entities are inside the view frustum, one
+   pass over the positions per plane with no branches in the loop; the hero
+   is always drawn since its parts turn about its body */
+void cullScene()
+{
+    int n=entityCount();
+    entityVisible.assign(n,1);
+    cullRadius.resize(n);
+    for(int i=0;i<n;i++)
+    {
+        cullRadius[i]=meshes.list[scene.mesh[i]].Radius;
+    }
+    const glm::vec3 *position=&scene.drawPosition[0];
+    const float *radius=&cullRadius[0];
+    unsigned char *visible=&entityVisible[0];
+    for(int p=0;p<6;p++)
+    {
+        const glm::vec4 plane=camera.frustum[p];
+        for(int i=0;i<n;i++)
+        {
+            float d=plane.x*position[i].x+plane.y*position[i].y+plane.z*position[i].z+plane.w;
+            visible[i]&=(d>=-radius[i]);
+        }
+    }
+    renderStats.culled=0;
+    for(int i=0;i<n;i++)
+    {
+        if(scene.flags[i]&ENTITY_HERO_PART)
+        {
+            visible[i]=1;
+        }
+        renderStats.culled+=!visible[i];
+    }
+}
 
-void drawobject(VAO* obj,glm::vec3 transi,float angle,glm::vec3 rotat,int i)
+bool sphereVisible(glm::vec3 centre,float radius)
 {
-    if(zoomFlag)
+    for(int p=0;p<6;p++)
     {
-        camAngle+=0.01f;
-        if(camAngle>=360)
+        if(glm::dot(camera.frustum[p],glm::vec4(centre,1.0f))<-radius)
         {
-            camAngle=0;
+            return false;
         }
-        Matrices.view = glm::lookAt(glm::vec3(700*cos(camAngle*(M_PI/180)),300,700*sin(camAngle*(M_PI/180))), glm::vec3(0,0,0), glm::vec3(0,1,0));
     }
-    if(zoom1Flag)
+    return true;
+}
+
+/* Pull the six clip planes out of a view-projection matrix */
+void extractFrustum(const glm::mat4& VP,glm::vec4 planes[6])
+{
+    for(int i=0;i<3;i++)
     {
-        camAngle-=0.01f;
-        if(camAngle<=0)
+        for(int k=0;k<2;k++)
         {
-            camAngle=360;
+            float sign = k==0 ? 1.0f : -1.0f;
+            glm::vec4 plane(VP[0][3]+sign*VP[0][i], VP[1][3]+sign*VP[1][i], VP[2][3]+sign*VP[2][i], VP[3][3]+sign*VP[3][i]);
+            float len = glm::length(glm::vec3(plane.x,plane.y,plane.z));
+            planes[2*i+k] = plane*(1.0f/len);
         }
-        Matrices.view = glm::lookAt(glm::vec3(700*cos(camAngle*(M_PI/180)),300,700*sin(camAngle*(M_PI/180))), glm::vec3(0,0,0), glm::vec3(0,1,0));
     }
-    else
+}
+
+/* Pick the camera mode from the held keys, advance it by elapsed seconds and build the view */
+void updateCamera(float elapsed)
+{
+    if(zoomFlag)
     {
-        Matrices.view = glm::lookAt(glm::vec3(700*cos(camAngle*(M_PI/180)),300,scrollLen+700*sin(camAngle*(M_PI/180))), glm::vec3(0,0,0), glm::vec3(0,1,0));
+        camera.angle=formatAngle(camera.angle+CAMERA_ORBIT_SPEED*elapsed);
     }
-    if(topFlag)
-    { 
-        Matrices.view = glm::lookAt(glm::vec3(0,500,30*sin(camAngle*(M_PI/180))), glm::vec3(0,0,0), glm::vec3(0,1,0));
+    if(zoom1Flag)
+    {
+        camera.angle=formatAngle(camera.angle-CAMERA_ORBIT_SPEED*elapsed);
     }
+    camera.mode=CAMERA_HELICOPTER;
+    if(topFlag)
+        camera.mode=CAMERA_TOWER;
     if(followFlag)
+        camera.mode=CAMERA_FOLLOW;
+    if(headCamFlag)
+        camera.mode=CAMERA_HEAD;
+
+    float angle=D2R(camera.angle);
+    switch(camera.mode)
     {
-        Matrices.view = glm::lookAt(glm::vec3(x+50*cos(camAngle*(M_PI/180)),y+80,z+50*sin(camAngle*(M_PI/180))), glm::vec3(x,y,z), glm::vec3(0,1,0));
+        case CAMERA_HELICOPTER:
+            // Scrolling only zooms while the orbit is not being turned backwards
+            camera.eye=glm::vec3(700*cos(angle),300,(zoom1Flag?0:scrollLen)+700*sin(angle));
+            camera.target=glm::vec3(0,0,0);
+            break;
+        case CAMERA_TOWER:
+            camera.eye=glm::vec3(0,500,30*sin(angle));
+            camera.target=glm::vec3(0,0,0);
+            break;
+        case CAMERA_FOLLOW:
+            camera.eye=glm::vec3(x+50*cos(angle),y+80,z+50*sin(angle));
+            camera.target=glm::vec3(x,y,z);
+            break;
+        case CAMERA_HEAD:
+            // Look the way the hero walks
+            camera.eye=glm::vec3(x,y+40,z);
+            camera.target=glm::vec3(x-40*sin(D2R(drawVarang)),y+40,z-40*cos(D2R(drawVarang)));
+            break;
     }
-    if(headCamFlag)
+    camera.view=glm::lookAt(camera.eye, camera.target, glm::vec3(0,1,0));
+    Matrices.view=camera.view;
+    extractFrustum(Matrices.projection*camera.view, camera.frustum);
+}
+
+void drawobject(int obj,glm::vec3 transi,float angle,glm::vec3 rotat,int i)
+{
+    Matrices.model = glm::mat4(1.0f);
+    glm::mat4 translatemat = glm::translate(transi);
+    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
+    Matrices.model *= (translatemat * rotatemat);
+    draw3DObject(obj,Matrices.model,scene.drawPosition[i]);
+}
+
+void drawHero(int obj,glm::vec3 trans,float angle,glm::vec3 rotat,glm::vec3 hero)
+{
+    Matrices.model = glm::mat4(1.0f);
+    glm::mat4 toorigin = glm::translate(trans-hero);
+    glm::mat4 rotateatorg = glm::rotate(D2R(formatAngle(drawVarang)), glm::vec3(0,1,0));
+    glm::mat4 translatemat = glm::translate(hero);
+    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
+    Matrices.model *= (translatemat*rotateatorg *toorigin* rotatemat);
+    draw3DObject(obj,Matrices.model,trans);
+}
+
+float dist(float x1,float y1,float z1,float x2,float y2,float z2)
+{
+    int dis=sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2)+(z1-z2)*(z1-z2));
+    return dis;
+}
+
+int countobj=0;
+float camera_rotation_angle = 90;
+float rectangle_rotation = 0;
+float triangle_rotation = 0;
+float rotate_angle=0,ang=0.0f;;
+glm::vec3 rot;
+bool rotRight=false,rotLeft=false,rotR=false,rotL=false,level=false;
+int backgroundTimer=0,presentLevel=1;
+Entity highlightedTile=noEntity;
+
+bool heroOnTile(int j)
+{
+    glm::vec3 &hero=positionOf(heroEntity);
+    glm::vec3 &tile=scene.position[j];
+    return round(hero[0])>tile[0]-20 && round(hero[0])<tile[0]+20 && round(hero[2])>tile[2]-20 && round(hero[2])<tile[2]+20;
+}
+
+// The lattice levels are laid out on: tile centres at -200+40k, each covering +-20
+#define GRID_CELL 40.0f
+#define GRID_ORIGIN -220.0f
+
+/* What stands on one cell of one level */
+struct GridCell {
+    Entity tile;            // floor tile, or the lowest segment of a pillar
+    Entity pillar;          // top segment of a pillar
+    bool pit;
+    vector<Entity> coins;   // coins whose pickup area reaches into the cell
+    GridCell() : tile(noEntity), pillar(noEntity), pit(false) {}
+};
+
+unordered_map<long long,GridCell> grid;
+
+int gridCoord(float v)
+{
+    return (int)floor((v-GRID_ORIGIN)/GRID_CELL);
+}
+
+float cellCentre(int c)
+{
+    return GRID_ORIGIN+(c+0.5f)*GRID_CELL;
+}
+
+long long gridKey(int level,int cx,int cz)
+{
+    return ((long long)level<<42) ^ ((long long)(cx&0x1fffff)<<21) ^ (long long)(cz&0x1fffff);
+}
+
+GridCell& gridCellAt(int level,int cx,int cz)
+{
+    return grid[gridKey(level,cx,cz)];
+}
+
+GridCell* findCell(int level,int cx,int cz)
+{
+    unordered_map<long long,GridCell>::iterator it=grid.find(gridKey(level,cx,cz));
+    return it==grid.end() ? NULL : &it->second;
+}
+
+/* Slot of the tile of a level the hero stands on, -1 if none */
+int tileUnder(int level)
+{
+    glm::vec3 &hero=positionOf(heroEntity);
+    GridCell *cell=findCell(level,gridCoord(round(hero[0])),gridCoord(round(hero[2])));
+    if(!cell)
+    {
+        return -1;
+    }
+    int j=slotOf(cell->tile);
+    return j!=-1 && heroOnTile(j) ? j : -1;
+}
+
+/* Whether p is within a pit of a level, edges included */
+bool overPit(glm::vec3 p,int level)
+{
+    int cx=gridCoord(p[0]),cz=gridCoord(p[2]);
+    // A point on a cell edge touches the neighbouring cell as well
+    for(int i=cx-1;i<=cx+1;i++)
+    {
+        for(int k=cz-1;k<=cz+1;k++)
+        {
+            GridCell *cell=findCell(level,i,k);
+            if(cell && cell->pit && fabs(p[0]-cellCentre(i))<=20 && fabs(p[2]-cellCentre(k))<=20)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Register a coin in every cell its pickup area overlaps */
+void addCoinToGrid(Entity coin,int level)
+{
+    glm::vec3 &p=positionOf(coin);
+    for(int i=gridCoord(p[0]);i<=gridCoord(p[0]+20);i++)
+    {
+        for(int k=gridCoord(p[2]-20);k<=gridCoord(p[2]+20);k++)
+        {
+            gridCellAt(level,i,k).coins.pb(coin);
+        }
+    }
+}
+
+/* Hide the coins the hero is touching */
+void collectCoins(glm::vec3 hero,int level)
+{
+    GridCell *cell=findCell(level,gridCoord(hero[0]),gridCoord(hero[2]));
+    if(!cell)
+    {
+        return;
+    }
+    for(int c=0;c<(int)cell->coins.size();c++)
+    {
+        int j=slotOf(cell->coins[c]);
+        if(j==-1)
+        {
+            continue;
+        }
+        glm::vec3 &coin=scene.position[j];
+        if(hero[0]>=coin[0] && hero[0]<=coin[0]+20 && hero[2]<=coin[2]+20 && hero[2]>=coin[2]-20)
+        {
+            //playSound("/home/varshit/Downloads/coin.mp3");
+            scene.flags[j]|=ENTITY_HIDDEN;
+        }
+    }
+}
+
+/* Hero collision: the body and both hands are boxes swept against the pillar
+   columns the grid finds around the move, and slide along what they hit */
+
+// Contacts this far inside a pillar still count, so rounding cannot let the hero tunnel
+#define COLLISION_SKIN 0.01f
+
+struct Box {
+    glm::vec3 centre;
+    glm::vec3 half;
+};
+
+/* World boxes of the hero parts, with the hands turned with the hero and swung about X */
+int heroBoxes(Box boxes[3])
+{
+    glm::vec3 &hero=positionOf(heroEntity);
+    float turn=D2R(varang);
+    float c=fabs(cos(turn)),s=fabs(sin(turn));
+    boxes[0].centre=hero;
+    boxes[0].half=glm::vec3(5,5,5);
+
+    Entity hands[2]={ leftHandEntity, rightHandEntity };
+    for(int k=0;k<2;k++)
+    {
+        glm::vec3 offset=positionOf(hands[k])-hero;
+        float swing=D2R(rotationOf(hands[k]));
+        float hx=5;
+        float hy=fabs(cos(swing))*15+fabs(sin(swing))*5;
+        float hz=fabs(sin(swing))*15+fabs(cos(swing))*5;
+        boxes[k+1].centre=hero+glm::vec3(offset[0]*cos(turn)+offset[2]*sin(turn),offset[1],-offset[0]*sin(turn)+offset[2]*cos(turn));
+        boxes[k+1].half=glm::vec3(c*hx+s*hz,hy,s*hx+c*hz);
+    }
+    return 3;
+}
+
+/* Fraction of move at which box first touches [lo,hi], 1 if it does not.
+   A box already well inside is let go, so it can always walk back out */
+float sweepBox(const Box& box,glm::vec3 move,glm::vec3 lo,glm::vec3 hi,int& axis)
+{
+    float enter=-FLT_MAX,leave=FLT_MAX;
+    axis=-1;
+    for(int a=0;a<3;a++)
+    {
+        float low=lo[a]-box.half[a],high=hi[a]+box.half[a];
+        if(move[a]==0)
+        {
+            if(box.centre[a]<=low || box.centre[a]>=high)
+            {
+                return 1;
+            }
+            continue;
+        }
+        float t0=(low-box.centre[a])/move[a];
+        float t1=(high-box.centre[a])/move[a];
+        if(t0>t1)
+        {
+            swap(t0,t1);
+        }
+        if(t0>enter)
+        {
+            enter=t0;
+            axis=a;
+        }
+        leave=min(leave,t1);
+    }
+    if(axis==-1 || enter>=leave || enter>=1 || leave<=0)
+    {
+        return 1;
+    }
+    if(enter<0)
+    {
+        if(-enter*fabs(move[axis])>COLLISION_SKIN)
+        {
+            return 1;
+        }
+        enter=0;
+    }
+    return enter;
+}
+
+/* Earliest hit of any hero part against the pillars of the present level */
+float sweepHero(glm::vec3 move,int& axis)
+{
+    Box boxes[3];
+    int count=heroBoxes(boxes);
+
+    // Broadphase: the cells the whole move passes over
+    glm::vec3 lo(FLT_MAX),hi(-FLT_MAX);
+    for(int b=0;b<count;b++)
+    {
+        for(int k=0;k<3;k++)
+        {
+            lo[k]=min(lo[k],min(boxes[b].centre[k],boxes[b].centre[k]+move[k])-boxes[b].half[k]);
+            hi[k]=max(hi[k],max(boxes[b].centre[k],boxes[b].centre[k]+move[k])+boxes[b].half[k]);
+        }
+    }
+
+    float first=1;
+    axis=-1;
+    for(int i=gridCoord(lo[0]);i<=gridCoord(hi[0]);i++)
+    {
+        for(int k=gridCoord(lo[2]);k<=gridCoord(hi[2]);k++)
+        {
+            GridCell *cell=findCell(presentLevel,i,k);
+            int bottom=cell ? slotOf(cell->tile) : -1;
+            int top=cell ? slotOf(cell->pillar) : -1;
+            if(bottom==-1 || top==-1)
+            {
+                continue;
+            }
+            // The whole column of segments is one box. It has no top, since even a
+            // one-segment wall must stop a hero at the top of a jump
+            glm::vec3 columnLo(cellCentre(i)-20,scene.position[bottom][1]-20,cellCentre(k)-20);
+            glm::vec3 columnHi(cellCentre(i)+20,FLT_MAX,cellCentre(k)+20);
+            for(int b=0;b<count;b++)
+            {
+                int hitAxis;
+                float t=sweepBox(boxes[b],move,columnLo,columnHi,hitAxis);
+                if(t<first)
+                {
+                    first=t;
+                    axis=hitAxis;
+                }
+            }
+        }
+    }
+    return first;
+}
+
+/* Move the hero and hands by move, stopping at pillars and sliding along them.
+   Returns whether they moved at all */
+bool moveHero(glm::vec3 move)
+{
+    bool moved=false;
+    for(int pass=0;pass<3;pass++)
+    {
+        int axis;
+        float t=sweepHero(move,axis);
+        glm::vec3 step=move*t;
+        if(step!=glm::vec3(0))
+        {
+            positionOf(heroEntity)+=step;
+            positionOf(leftHandEntity)+=step;
+            positionOf(rightHandEntity)+=step;
+            moved=true;
+        }
+        if(t>=1)
+        {
+            break;
+        }
+        // Keep only the part of the rest that runs along the face that was hit
+        move-=step;
+        move[axis]=0;
+        if(move==glm::vec3(0))
+        {
+            break;
+        }
+    }
+    return moved;
+}
+
+/* Move the highlight to the tile under the hero, touching only the old and new tile */
+void updateTileHighlight()
+{
+    int tile=tileUnder(presentLevel);
+    int old=slotOf(highlightedTile);
+    if(tile==old)
+    {
+        return;
+    }
+    if(old!=-1)
+    {
+        scene.flags[old]&=~ENTITY_HIGHLIGHT;
+    }
+    highlightedTile=noEntity;
+    if(tile!=-1)
+    {
+        scene.flags[tile]|=ENTITY_HIGHLIGHT;
+        highlightedTile=entityAt(tile);
+    }
+}
+
+/* Objects sharing one mesh, drawn with a single glDrawElementsInstanced.
+   Members are the entities whose batch component points here */
+struct InstanceBatch {
+    int mesh;
+    GpuHandle VertexArrayID;
+    GpuHandle InstanceBuffer;
+    bool overlay;               // drawn over coplanar geometry, so pulled towards the camera
+    int capacity;               // instances the buffer has room for
+    vector<GLfloat> data;       // built every frame, reuses its storage
+    vector<GLfloat> uploaded;   // what the instance buffer holds right now
+};
+
+// Per instance: translation x,y,z, rotation about Y, highlight
+#define INSTANCE_FLOATS 5
+
+vector<InstanceBatch> batches;
+
+
+int createBatch(int mesh)
+{
+    InstanceBatch batch;
+    batch.mesh=mesh;
+    batch.overlay=false;
+    batch.capacity=0;
+    batches.pb(batch);
+    return batches.size()-1;
+}
+
+void addToBatch(int batch,Entity entity)
+{
+    int i=slotOf(entity);
+    scene.batch[i]=batch;
+    scene.flags[i]|=ENTITY_INSTANCED;
+}
+
+/* Create the VAO and instance buffer of every batch - call once all objects are added */
+void uploadBatches()
+{
+    for(int b=0;b<(int)batches.size();b++)
+    {
+        batches[b].capacity=0;
+    }
+    for(int i=0;i<entityCount();i++)
+    {
+        if(scene.batch[i]!=-1)
+        {
+            batches[scene.batch[i]].capacity+=1;
+        }
+    }
+    for(int b=0;b<(int)batches.size();b++)
+    {
+        InstanceBatch &batch=batches[b];
+        batch.data.reserve(INSTANCE_FLOATS*batch.capacity);
+        batch.uploaded.reserve(INSTANCE_FLOATS*batch.capacity);
+
+        batch.VertexArrayID=genVertexArray();
+        glBindVertexArray(batch.VertexArrayID);
+
+        // Per vertex data and indices come straight from the shared mesh buffers
+        glBindBuffer(GL_ARRAY_BUFFER, meshes.VertexBuffer);
+        bindVertexLayout();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshes.IndexBuffer);
+
+        // Per instance data advances once per instance
+        batch.InstanceBuffer=genBuffer();
+        glBindBuffer(GL_ARRAY_BUFFER, batch.InstanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, INSTANCE_FLOATS*max(batch.capacity,1)*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS*sizeof(GLfloat), (void*)0);
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+        glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS*sizeof(GLfloat), (void*)(4*sizeof(GLfloat)));
+        glEnableVertexAttribArray(4);
+        glVertexAttribDivisor(4, 1);
+    }
+    glBindVertexArray(0);
+}
+
+/* Refresh the instance buffer only if a member moved, then queue the whole batch */
+void queueBatch(InstanceBatch &batch)
+{
+    int count=batch.data.size()/INSTANCE_FLOATS;
+    if(count==0)
+    {
+        return;
+    }
+    if(count>batch.capacity)
+    {
+        // Entities joined after the upload, make room for twice as many
+        batch.capacity=2*count;
+        glBindBuffer(GL_ARRAY_BUFFER, batch.InstanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, INSTANCE_FLOATS*batch.capacity*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+        batch.uploaded.clear();
+    }
+    if(batch.data!=batch.uploaded)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, batch.InstanceBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, batch.data.size()*sizeof(GLfloat), &batch.data[0]);
+        batch.uploaded=batch.data;
+    }
+    const Mesh &mesh=meshes.list[batch.mesh];
+    DrawPacket packet;
+    packet.program=&instancedPrograms[frameLighting];
+    packet.vertexArray=batch.VertexArrayID;
+    packet.fillMode=mesh.FillMode;
+    packet.overlay=batch.overlay;
+    packet.primitiveMode=mesh.PrimitiveMode;
+    packet.indexType=GL_UNSIGNED_SHORT;
+    packet.firstByte=mesh.FirstIndex*sizeof(GLushort);
+    packet.count=mesh.NumIndices;
+    packet.instances=count;
+    queuePacket(packet);
+}
+
+void queueBatches()
+{
+    for(int b=0;b<(int)batches.size();b++)
+    {
+        batches[b].data.clear();
+    }
+    // One pass over the store fills every batch
+    for(int i=0;i<entityCount();i++)
+    {
+        if(scene.batch[i]==-1 || (scene.flags[i]&ENTITY_HIDDEN) || !entityVisible[i])
+        {
+            continue;
+        }
+        if((scene.flags[i]&(ENTITY_MERGED|ENTITY_HIGHLIGHT))==ENTITY_MERGED)
+        {
+            continue;
+        }
+        vector<GLfloat> &data=batches[scene.batch[i]].data;
+        data.pb(scene.drawPosition[i][0]);
+        data.pb(scene.drawPosition[i][1]);
+        data.pb(scene.drawPosition[i][2]);
+        data.pb(formatAngle(scene.drawRotation[i]));
+        data.pb((scene.flags[i]&ENTITY_HIGHLIGHT)?1.0f:0.0f);
+    }
+
+    for(int b=0;b<(int)batches.size();b++)
+    {
+        queueBatch(batches[b]);
+    }
+}
+
+/* Level 2 is lit by the hero's spotlight, level 3 is dim */
+Lighting lightingFor(int level)
+{
+    if(level==2)
+    {
+        return LIGHT_SPOTLIGHT;
+    }
+    if(level==3)
+    {
+        return LIGHT_DIM;
+    }
+    return LIGHT_PLAIN;
+}
+
+/* Upload the per-frame uniforms once, every program reads them from the same
+   block, and pick the lighting variant the frame draws with */
+void updateFrameUniforms()
+{
+    FrameUniforms frame;
+    frame.VP = Matrices.projection * Matrices.view;
+    frame.playerPosition = glm::vec4(scene.drawPosition[slotOf(heroEntity)],1.0f);
+    frame.playerHeading = glm::vec4(-sin(D2R(drawVarang)),0,-cos(D2R(drawVarang)),0);
+    frame.spotlightCos = cos(D2R(SPOTLIGHT_HALF_ANGLE));
+    frame.padding[0] = frame.padding[1] = frame.padding[2] = 0.0f;
+    frameLighting = lightingFor(presentLevel);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+}
+
+/* Levels come from levels/levels.pack, or one at a time from levels/levelN.lvl
+   (binary) or levels/levelN.txt (text source). Only the level being played and
+   the next one are built; the next is loaded when the hero arrives on a level.
+
+   Text source:
+       # comment
+       size 11 10          width (x) and depth (z) in tiles
+       origin -200 -200    centre of the first tile, on the 40-unit lattice
+       pillar 1            height of '#' pillars
+       coin -100 140       a coin, one line each
+       map                 then depth rows of width characters:
+                           . floor   _ pit   # pillar   1-9 pillar that many segments high
+
+   Binary level, little endian:
+       "LVL1", u16 width, u16 depth, i16 originX, i16 originZ, u16 coins,
+       width*depth cell bytes (type in the low nibble, pillar height in the high one),
+       coins * (i16 x, i16 z)
+
+   Pack: "LPK1", u32 levels, then u32 offset and u32 size of levels 1..n,
+   then the binary levels, each on a 4-byte boundary. The pack is mapped into
+   memory and levels are read where they lie, so opening it costs the same
+   however many levels it holds */
+
+#define TILE_SIZE 40.0f
+#define TILE_PIT 0
+#define TILE_FLOOR 1
+#define TILE_PILLAR 2
+#define LEVEL_HEADER 14
+
+// Where the level being played sits, and how far below it the next one waits
+#define LEVEL_Y -100.0f
+#define LEVEL_DROP 300.0f
+
+struct LevelCoin {
+    short x,z;
+};
+
+/* A level as written in its text source */
+struct LevelSource {
+    int width,depth;
+    int originX,originZ;
+    vector<unsigned char> cells;
+    vector<LevelCoin> coins;
+};
+
+/* A loaded level. cells and coins point into the pack mapping, or into
+   storage for levels read from single files */
+struct Level {
+    int number;
+    int width,depth;
+    int originX,originZ;
+    const unsigned char *cells;     // row by row, z then x
+    const unsigned char *coins;     // i16 x, i16 z each
+    int coinCount;
+    vector<unsigned char> storage;
+    float y;                        // floor height, rises into place when the level is reached
+
+    // With --mesh-floors, the floor tiles drawn as one mesh placed at floorAnchor
+    Entity floorAnchor;
+    GpuHandle floorArray;
+    GpuHandle floorBuffer;
+    GpuHandle floorIndexBuffer;
+    int floorIndexCount;
+    glm::vec3 floorCentre;          // bounding sphere, relative to the anchor
+    float floorRadius;
+};
+
+// Draw each level's floor as one merged mesh instead of a cube per tile
+bool meshFloors=false;
+
+struct LevelPack {
+    const unsigned char *data;
+    size_t size;
+    int count;
+} levelPack = { NULL, 0, 0 };
+
+map<int,Level> levels;
+int floorBatch,pillarBatch,coinBatch,cornerBatch;
+int cornerPyramid,coinPyramid;
+
+bool parseLevelText(const char* path,LevelSource& level)
+{
+    ifstream in(path);
+    if(!in.is_open())
+    {
+        return false;
+    }
+    level.width=level.depth=0;
+    level.originX=level.originZ=0;
+    level.cells.clear();
+    level.coins.clear();
+    int pillar=1,row=0,line=0;
+    bool inMap=false;
+    string text;
+    while(getline(in,text))
+    {
+        line+=1;
+        if(inMap)
+        {
+            if(row==level.depth)
+            {
+                break;
+            }
+            if((int)text.size()<level.width)
+            {
+                fprintf(stderr, "Error: %s:%d: map row is shorter than %d tiles\n", path, line, level.width);
+                return false;
+            }
+            for(int j=0;j<level.width;j++)
+            {
+                char c=text[j];
+                unsigned char cell;
+                if(c=='.')
+                    cell=TILE_FLOOR;
+                else if(c=='_')
+                    cell=TILE_PIT;
+                else if(c=='#')
+                    cell=TILE_PILLAR | pillar<<4;
+                else if(c>='1' && c<='9')
+                    cell=TILE_PILLAR | (c-'0')<<4;
+                else
+                {
+                    fprintf(stderr, "Error: %s:%d: unknown tile '%c'\n", path, line, c);
+                    return false;
+                }
+                level.cells.pb(cell);
+            }
+            row+=1;
+            continue;
+        }
+        istringstream words(text);
+        string key;
+        if(!(words >> key) || key[0]=='#')
+        {
+            continue;
+        }
+        bool ok=true;
+        if(key=="size")
+            ok=(words >> level.width >> level.depth) && level.width>0 && level.depth>0 && level.width<=65535 && level.depth<=65535;
+        else if(key=="origin")
+            ok=(bool)(words >> level.originX >> level.originZ);
+        else if(key=="pillar")
+            ok=(words >> pillar) && pillar>=1 && pillar<=15;
+        else if(key=="coin")
+        {
+            int x,z;
+            ok=(bool)(words >> x >> z);
+            LevelCoin coin={ (short)x, (short)z };
+            level.coins.pb(coin);
+        }
+        else if(key=="map")
+            inMap=true;
+        else
+            ok=false;
+        if(!ok)
+        {
+            fprintf(stderr, "Error: %s:%d: bad line '%s'\n", path, line, text.c_str());
+            return false;
+        }
+    }
+    if(row<level.depth || level.width==0)
+    {
+        fprintf(stderr, "Error: %s: the map needs %d rows of %d tiles\n", path, level.depth, level.width);
+        return false;
+    }
+    return true;
+}
+
+void putLE(vector<unsigned char>& out,unsigned long value,int bytes)
+{
+    for(int i=0;i<bytes;i++)
+    {
+        out.pb((value>>(8*i))&0xff);
+    }
+}
+
+unsigned long readLE(const unsigned char* p,int bytes)
+{
+    unsigned long value=0;
+    for(int i=0;i<bytes;i++)
+    {
+        value|=(unsigned long)p[i]<<(8*i);
+    }
+    return value;
+}
+
+/* Append the binary form of a level */
+void encodeLevel(const LevelSource& level,vector<unsigned char>& out)
+{
+    out.insert(out.end(), "LVL1", "LVL1"+4);
+    putLE(out, level.width, 2);
+    putLE(out, level.depth, 2);
+    putLE(out, (unsigned short)level.originX, 2);
+    putLE(out, (unsigned short)level.originZ, 2);
+    putLE(out, level.coins.size(), 2);
+    out.insert(out.end(), level.cells.begin(), level.cells.end());
+    for(int c=0;c<(int)level.coins.size();c++)
+    {
+        putLE(out, (unsigned short)level.coins[c].x, 2);
+        putLE(out, (unsigned short)level.coins[c].z, 2);
+    }
+}
+
+/* Point a level at a binary level in memory, checking it fits */
+bool viewLevel(const unsigned char* data,size_t size,Level& level)
+{
+    if(size<LEVEL_HEADER || memcmp(data, "LVL1", 4))
+    {
+        return false;
+    }
+    level.width=readLE(data+4,2);
+    level.depth=readLE(data+6,2);
+    level.originX=(short)readLE(data+8,2);
+    level.originZ=(short)readLE(data+10,2);
+    level.coinCount=readLE(data+12,2);
+    level.cells=data+LEVEL_HEADER;
+    level.coins=level.cells+(size_t)level.width*level.depth;
+    return size==LEVEL_HEADER+(size_t)level.width*level.depth+4*(size_t)level.coinCount;
+}
+
+bool readFile(const char* path,vector<unsigned char>& data)
+{
+    FILE *file=fopen(path, "rb");
+    if(!file)
+    {
+        return false;
+    }
+    unsigned char chunk[4096];
+    size_t got;
+    data.clear();
+    while((got=fread(chunk, 1, sizeof(chunk), file))>0)
+    {
+        data.insert(data.end(), chunk, chunk+got);
+    }
+    fclose(file);
+    return true;
+}
+
+/* Map the level pack for the life of the process, since loaded levels point
+   into it. Without one, levels are read from single files */
+void openLevelPack(const char* path)
+{
+    int fd=open(path, O_RDONLY);
+    if(fd==-1)
+    {
+        return;
+    }
+    struct stat info;
+    void *data=MAP_FAILED;
+    if(fstat(fd, &info)==0 && info.st_size>=8)
+    {
+        data=mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(data==MAP_FAILED)
+    {
+        fprintf(stderr, "Error: could not map %s\n", path);
+        return;
+    }
+    const unsigned char *bytes=(const unsigned char*)data;
+    int count=readLE(bytes+4,4);
+    if(memcmp(bytes, "LPK1", 4) || 8+8*(size_t)count>(size_t)info.st_size)
+    {
+        fprintf(stderr, "Error: %s is not a level pack\n", path);
+        munmap(data, info.st_size);
+        return;
+    }
+    levelPack.data=bytes;
+    levelPack.size=info.st_size;
+    levelPack.count=count;
+}
+
+/* Fill level n, from the pack if it has it. False if there is no such level */
+bool readLevel(int n,Level& level)
+{
+    char path[64];
+    bool found=false;
+    if(n>=1 && n<=levelPack.count)
+    {
+        const unsigned char *entry=levelPack.data+8+8*(n-1);
+        size_t offset=readLE(entry,4),size=readLE(entry+4,4);
+        snprintf(path, sizeof(path), "level %d of the pack", n);
+        found=offset<=levelPack.size && size<=levelPack.size-offset && viewLevel(levelPack.data+offset,size,level);
+        if(!found)
+        {
+            fprintf(stderr, "Error: %s is damaged\n", path);
+        }
+    }
+    if(!found)
+    {
+        snprintf(path, sizeof(path), "levels/level%d.lvl", n);
+        found=readFile(path,level.storage) && viewLevel(&level.storage[0],level.storage.size(),level);
+    }
+    if(!found)
+    {
+        snprintf(path, sizeof(path), "levels/level%d.txt", n);
+        LevelSource source;
+        if(parseLevelText(path,source))
+        {
+            level.storage.clear();
+            encodeLevel(source,level.storage);
+            found=viewLevel(&level.storage[0],level.storage.size(),level);
+        }
+    }
+    level.number=n;
+    level.floorAnchor=noEntity;
+    level.floorIndexCount=0;
+    // The grid only works if tiles sit on its lattice
+    if(found && (fmod(level.originX-(GRID_ORIGIN+TILE_SIZE/2),TILE_SIZE)!=0 || fmod(level.originZ-(GRID_ORIGIN+TILE_SIZE/2),TILE_SIZE)!=0))
+    {
+        fprintf(stderr, "Error: %s: origin %d %d is off the %g unit tile lattice\n", path, level.originX, level.originZ, TILE_SIZE);
+        found=false;
+    }
+    return found;
+}
+
+/* Levels are read and laid out by a loader thread while the current one is
+   played. The game thread turns the pieces into entities and grid cells a
+   slice at a time at the start of each frame, so no frame pays for a whole
+   level, and a level is only waited for if the hero falls in before it is in */
+
+// Pieces turned into entities per frame
+#define LEVEL_SLICE 64
+#define LEVEL_QUEUE_SIZE 8
+
+#define PIECE_FLOOR 0
+#define PIECE_PILLAR 1
+#define PIECE_BASE 2            // bottom segment of a pillar, what the cell stands on
+#define PIECE_PIT 3
+#define PIECE_CORNER 4
+#define PIECE_COIN 5
+
+/* Something a level puts in the scene, height measured from its floor */
+struct LevelPiece {
+    int kind;
+    glm::vec3 offset;
+};
+
+/* A level on its way from the loader thread to the scene */
+struct PreparedLevel {
+    int number;
+    float y;
+    bool found;
+    Level level;
+    vector<LevelPiece> pieces;
+    int pieceCounts[PIECE_COIN+1];
+    vector<Vertex> floorVertices;   // merged floor, if floors are meshed
+    vector<GLuint> floorIndices;
+    glm::vec3 floorCentre;
+    float floorRadius;
+};
+
+/* The game thread sends requests through one ring, the loader answers through the other */
+typedef SpscRing<PreparedLevel*,LEVEL_QUEUE_SIZE> LevelQueue;
+
+struct LevelLoader {
+    thread worker;
+    atomic<bool> running;
+    LevelQueue requests;
+    LevelQueue results;
+    set<int> pending;           // asked for and not yet fully built
+    PreparedLevel *building;    // being turned into entities
+    int next;                   // its next piece
+} loader;
+
+void addPiece(PreparedLevel& prepared,int kind,glm::vec3 offset)
+{
+    LevelPiece piece={ kind, offset };
+    prepared.pieces.pb(piece);
+    prepared.pieceCounts[kind]+=1;
+}
+
+/* List what a level puts in the scene. Touches nothing the game thread owns */
+void layOutLevel(PreparedLevel& prepared)
+{
+    const Level &level=prepared.level;
+    memset(prepared.pieceCounts, 0, sizeof(prepared.pieceCounts));
+    prepared.pieces.reserve(level.width*level.depth+4+level.coinCount);
+    for(int i=0;i<level.depth;i++)
+    {
+        float numZ=level.originZ+TILE_SIZE*i;
+        for(int j=0;j<level.width;j++)
+        {
+            float numX=level.originX+TILE_SIZE*j;
+            int type=level.cells[i*level.width+j]&0xf;
+            int height=level.cells[i*level.width+j]>>4;
+            if(type==TILE_FLOOR)
+            {
+                addPiece(prepared,PIECE_FLOOR,glm::vec3(numX,0,numZ));
+            }
+            else if(type==TILE_PILLAR)
+            {
+                for(int l=0;l<height;l++)
+                {
+                    addPiece(prepared,l==0 ? PIECE_BASE : PIECE_PILLAR,glm::vec3(numX,TILE_SIZE*(l+1),numZ));
+                }
+            }
+            else
+            {
+                addPiece(prepared,PIECE_PIT,glm::vec3(numX,0,numZ));
+            }
+        }
+    }
+    //Pyramids mark the corner tiles
+    float right=level.originX+TILE_SIZE*(level.width-1),back=level.originZ+TILE_SIZE*(level.depth-1);
+    const glm::vec3 corners[4]={ glm::vec3(right,0,back), glm::vec3(right,0,level.originZ), glm::vec3(level.originX,0,level.originZ), glm::vec3(level.originX,0,back) };
+    for(int c=0;c<4;c++)
+    {
+        addPiece(prepared,PIECE_CORNER,corners[c]+glm::vec3(0,TILE_SIZE/2,0));
+    }
+    //Coins float half a tile above the floor
+    for(int c=0;c<level.coinCount;c++)
+    {
+        float coinX=(short)readLE(level.coins+4*c,2),coinZ=(short)readLE(level.coins+4*c+2,2);
+        addPiece(prepared,PIECE_COIN,glm::vec3(coinX,TILE_SIZE/2,coinZ));
+    }
+}
+
+bool floorAt(const Level& level,int i,int j)
+{
+    return i>=0 && i<level.depth && j>=0 && j<level.width && (level.cells[i*level.width+j]&0xf)==TILE_FLOOR;
+}
+
+/* One face of the box lo..hi, corners from boxFaces */
+void addBoxFace(PreparedLevel& prepared,int face,glm::vec3 lo,glm::vec3 hi,const GLfloat* rgb)
+{
+    const float u[4]={ 0,1,1,0 },v[4]={ 0,0,1,1 };
+    GLuint base=prepared.floorVertices.size();
+    for(int c=0;c<4;c++)
+    {
+        const signed char *corner=boxFaces[face][c];
+        glm::vec3 p(corner[0]<0 ? lo.x : hi.x,corner[1]<0 ? lo.y : hi.y,corner[2]<0 ? lo.z : hi.z);
+        prepared.floorVertices.pb(makeVertex(p.x,p.y,p.z,rgb,u[c],v[c]));
+    }
+    const GLuint quad[6]={ 0,1,2, 0,2,3 };
+    for(int k=0;k<6;k++)
+    {
+        prepared.floorIndices.pb(base+quad[k]);
+    }
+}
+
+/* Merge the floor tiles of a level into one mesh: greedy rectangles over the
+   floor cells, each with one top and one bottom quad, and side quads only
+   along runs of edges that face a pit, a pillar or the outside. Positions are
+   relative to the first floor tile, which the mesh is drawn at */
+void meshFloor(PreparedLevel& prepared)
+{
+    const Level &level=prepared.level;
+    const GLfloat top[3]={ 1,1,0 },side[3]={ 1,102.0/255.0f,0 };
+    const float half=TILE_SIZE/2;
+    vector<unsigned char> merged(level.width*level.depth,0);
+    glm::vec3 lowest(FLT_MAX),highest(-FLT_MAX);
+    bool first=true;
+    glm::vec3 origin;
+    for(int i=0;i<level.depth;i++)
+    {
+        for(int j=0;j<level.width;j++)
+        {
+            if(!floorAt(level,i,j) || merged[i*level.width+j])
+            {
+                continue;
+            }
+            if(first)
+            {
+                origin=glm::vec3(level.originX+TILE_SIZE*j,0,level.originZ+TILE_SIZE*i);
+                first=false;
+            }
+            // Widen along x, then deepen along z while whole rows are free floor
+            int j1=j,i1=i;
+            while(floorAt(level,i,j1+1) && !merged[i*level.width+j1+1])
+            {
+                j1+=1;
+            }
+            for(bool grow=true;grow;)
+            {
+                for(int k=j;k<=j1 && grow;k++)
+                {
+                    grow=floorAt(level,i1+1,k) && !merged[(i1+1)*level.width+k];
+                }
+                if(grow)
+                {
+                    i1+=1;
+                }
+            }
+            for(int a=i;a<=i1;a++)
+            {
+                for(int b=j;b<=j1;b++)
+                {
+                    merged[a*level.width+b]=1;
+                }
+            }
+
+            float x0=level.originX+TILE_SIZE*j-half,x1=level.originX+TILE_SIZE*j1+half;
+            float z0=level.originZ+TILE_SIZE*i-half,z1=level.originZ+TILE_SIZE*i1+half;
+            glm::vec3 lo=glm::vec3(x0,-half,z0)-origin,hi=glm::vec3(x1,half,z1)-origin;
+            lowest=glm::min(lowest,lo);
+            highest=glm::max(highest,hi);
+            addBoxFace(prepared,BOX_TOP,lo,hi,top);
+            addBoxFace(prepared,BOX_BOTTOM,lo,hi,side);
+
+            // Sides facing x: faces 0 and 1, walking the rows of the rectangle
+            for(int f=0;f<2;f++)
+            {
+                int beside=f==0 ? j-1 : j1+1;
+                for(int a=i;a<=i1;a++)
+                {
+                    int b=a;
+                    while(b<=i1 && !floorAt(level,b,beside))
+                    {
+                        b+=1;
+                    }
+                    if(b>a)
+                    {
+                        addBoxFace(prepared,f,glm::vec3(lo.x,lo.y,lo.z+TILE_SIZE*(a-i)),glm::vec3(hi.x,hi.y,lo.z+TILE_SIZE*(b-i)),side);
+                    }
+                    a=b;
+                }
+            }
+            // Sides facing z: faces 4 and 5, walking the columns
+            for(int f=4;f<6;f++)
+            {
+                int beside=f==4 ? i-1 : i1+1;
+                for(int a=j;a<=j1;a++)
+                {
+                    int b=a;
+                    while(b<=j1 && !floorAt(level,beside,b))
+                    {
+                        b+=1;
+                    }
+                    if(b>a)
+                    {
+                        addBoxFace(prepared,f,glm::vec3(lo.x+TILE_SIZE*(a-j),lo.y,lo.z),glm::vec3(lo.x+TILE_SIZE*(b-j),hi.y,hi.z),side);
+                    }
+                    a=b;
+                }
+            }
+        }
+    }
+    if(!first)
+    {
+        prepared.floorCentre=(lowest+highest)*0.5f;
+        prepared.floorRadius=glm::length(highest-lowest)*0.5f;
+    }
+}
+
+void levelLoaderThread()
+{
+    while(loader.running.load(memory_order_acquire))
+    {
+        PreparedLevel *prepared;
+        if(!loader.requests.pop(prepared))
+        {
+            this_thread::sleep_for(chrono::milliseconds(2));
+            continue;
+        }
+        prepared->found=readLevel(prepared->number,prepared->level);
+        if(prepared->found)
+        {
+            layOutLevel(*prepared);
+            if(meshFloors)
+            {
+                meshFloor(*prepared);
+            }
+        }
+        // There are never more levels in flight than the queue holds
+        loader.results.push(prepared);
+    }
+}
+
+void startLevelLoader()
+{
+    loader.requests.clear();
+    loader.results.clear();
+    loader.building=NULL;
+    loader.running=true;
+    loader.worker=thread(levelLoaderThread);
+}
+
+void stopLevelLoader()
+{
+    if(!loader.running)
+    {
+        return;
+    }
+    loader.running=false;
+    loader.worker.join();
+}
+
+/* Ask for level n with its floor at yPos. It joins the scene over the next frames */
+void requestLevel(int n,float yPos)
+{
+    if(loader.pending.count(n) || levels.count(n) || loader.pending.size()>=LEVEL_QUEUE_SIZE)
+    {
+        return;
+    }
+    PreparedLevel *prepared=new PreparedLevel;
+    prepared->number=n;
+    prepared->y=yPos;
+    prepared->found=false;
+    loader.pending.insert(n);
+    loader.requests.push(prepared);
+}
+
+/* Make room in a batch's instance buffer before its members arrive, so the
+   frames that add them don't also reallocate it */
+void reserveBatch(int b,int extra)
+{
+    InstanceBatch &batch=batches[b];
+    int needed=batch.data.size()/INSTANCE_FLOATS+extra;
+    if(batch.InstanceBuffer==0 || needed<=batch.capacity)
+    {
+        return;
+    }
+    batch.capacity=needed;
+    batch.data.reserve(INSTANCE_FLOATS*needed);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.InstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, INSTANCE_FLOATS*batch.capacity*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+    batch.uploaded.clear();
+}
+
+/* Give a level its merged floor mesh, in buffers of its own that go with it */
+void uploadLevelFloor(Level& level,const PreparedLevel& prepared)
+{
+    if(prepared.floorIndices.empty())
+    {
+        return;
+    }
+    level.floorArray=genVertexArray();
+    level.floorBuffer=genBuffer();
+    level.floorIndexBuffer=genBuffer();
+    glBindVertexArray(level.floorArray);
+    glBindBuffer(GL_ARRAY_BUFFER, level.floorBuffer);
+    glBufferData(GL_ARRAY_BUFFER, prepared.floorVertices.size()*sizeof(Vertex), &prepared.floorVertices[0], GL_STATIC_DRAW);
+    bindVertexLayout();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, level.floorIndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, prepared.floorIndices.size()*sizeof(GLuint), &prepared.floorIndices[0], GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    level.floorIndexCount=prepared.floorIndices.size();
+    level.floorCentre=prepared.floorCentre;
+    level.floorRadius=prepared.floorRadius;
+}
+
+/* Create the entity or grid cell of one piece of a level */
+void buildPiece(Level& level,const LevelPiece& piece)
+{
+    glm::vec3 position=piece.offset+glm::vec3(0,level.y,0);
+    GridCell &cell=gridCellAt(level.number,gridCoord(position[0]),gridCoord(position[2]));
+    if(piece.kind==PIECE_FLOOR)
+    {
+        // The tile stays for the grid and the highlight even when the level mesh draws it
+        Entity tile=createEntity(cube,position,level.floorIndexCount ? ENTITY_MERGED : 0,level.number);
+        addToBatch(floorBatch,tile);
+        cell.tile=tile;
+        if(slotOf(level.floorAnchor)==-1)
+        {
+            level.floorAnchor=tile;
+        }
+    }
+    else if(piece.kind==PIECE_PILLAR || piece.kind==PIECE_BASE)
+    {
+        Entity segment=createEntity(cube,position,0,level.number);
+        addToBatch(pillarBatch,segment);
+        if(piece.kind==PIECE_BASE)
+        {
+            cell.tile=segment;
+        }
+        cell.pillar=segment;
+    }
+    else if(piece.kind==PIECE_PIT)
+    {
+        cell.pit=true;
+    }
+    else if(piece.kind==PIECE_CORNER)
+    {
+        addToBatch(cornerBatch,createEntity(cornerPyramid,position,0,level.number));
+    }
+    else
+    {
+        Entity coin=createEntity(coinPyramid,position,ENTITY_COIN,level.number);
+        addToBatch(coinBatch,coin);
+        addCoinToGrid(coin,level.number);
+    }
+}
+
+/* Build at most budget pieces of the levels the loader has finished.
+   Returns false once there is nothing left to do this frame */
+bool streamLevels(int budget)
+{
+    while(budget>0)
+    {
+        if(!loader.building)
+        {
+            PreparedLevel *prepared;
+            if(!loader.results.pop(prepared))
+            {
+                return false;
+            }
+            if(!prepared->found)
+            {
+                loader.pending.erase(prepared->number);
+                delete prepared;
+                continue;
+            }
+            // Moving keeps the storage a single-file level points into
+            Level &level=levels[prepared->number];
+            level=move(prepared->level);
+            level.y=prepared->y;
+            uploadLevelFloor(level,*prepared);
+            reserveBatch(floorBatch,prepared->pieceCounts[PIECE_FLOOR]);
+            reserveBatch(pillarBatch,prepared->pieceCounts[PIECE_PILLAR]+prepared->pieceCounts[PIECE_BASE]);
+            reserveBatch(cornerBatch,prepared->pieceCounts[PIECE_CORNER]);
+            reserveBatch(coinBatch,prepared->pieceCounts[PIECE_COIN]);
+            loader.building=prepared;
+            loader.next=0;
+        }
+        PreparedLevel *prepared=loader.building;
+        Level &level=levels[prepared->number];
+        int count=min(budget,(int)prepared->pieces.size()-loader.next);
+        for(int p=0;p<count;p++)
+        {
+            buildPiece(level,prepared->pieces[loader.next+p]);
+        }
+        loader.next+=count;
+        budget-=count;
+        if(loader.next==(int)prepared->pieces.size())
+        {
+            loader.pending.erase(prepared->number);
+            loader.building=NULL;
+            delete prepared;
+        }
+    }
+    return true;
+}
+
+/* Wait until level n is in the scene, or known not to exist */
+void finishLevel(int n)
+{
+    while(loader.pending.count(n))
+    {
+        if(!streamLevels(INT_MAX))
+        {
+            this_thread::yield();
+        }
+    }
+}
+
+/* Drop level n: its entities, its grid cells and its description */
+void unloadLevel(int n)
+{
+    for(int i=entityCount()-1;i>=0;i--)
+    {
+        if(scene.level[i]==n)
+        {
+            destroyEntity(entityAt(i));
+        }
+    }
+    for(unordered_map<long long,GridCell>::iterator it=grid.begin();it!=grid.end();)
     {
-        float lookX=-40*cos(90-varang*(M_PI/180));
-        float lookY=-40*sin(90-varang*(M_PI/180));
-        Matrices.view = glm::lookAt(glm::vec3(x,y+40,z), glm::vec3(x+lookX,y+40,z+lookY), glm::vec3(0,1,0));
+        if((it->first>>42)==n)
+            it=grid.erase(it);
+        else
+            ++it;
     }
-    glm::mat4 VP = Matrices.projection * Matrices.view;
-    glm::mat4 MVP;
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translatemat = glm::translate(transi);
-    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
-    Matrices.model *= (translatemat * rotatemat);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    GLint myUniformLocation = glGetUniformLocation(programID, "playerPosition");            
-    glUniform3f(myUniformLocation, 1.0, 2.0, 3.0);
-    myUniformLocation = glGetUniformLocation(programID, "objectPosition");            
-    glUniform3f(myUniformLocation,trans[i][0],trans[i][1],trans[i][2]);
-    myUniformLocation = glGetUniformLocation(programID, "playerAngle");            
-    glUniform1f(myUniformLocation,varang);
-    draw3DObject(obj);
+    levels.erase(n);
 }
 
-void drawHero(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat,glm::vec3 hero)
+/* The hero has arrived on presentLevel: forget the one above, start on the one below */
+void finishLevelChange()
 {
-    glm::mat4 VP = Matrices.projection * Matrices.view;
-    glm::mat4 MVP;
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 toorigin = glm::translate(trans-hero);
-    glm::mat4 rotateatorg = glm::rotate(D2R(formatAngle(varang)), glm::vec3(0,1,0));
-    glm::mat4 translatemat = glm::translate(hero);
-    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
-    Matrices.model *= (translatemat*rotateatorg *toorigin* rotatemat);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    GLint myUniformLocation = glGetUniformLocation(programID, "playerPosition");            
-    glUniform3f(myUniformLocation,trans[heroIndex][0],trans[heroIndex][1],trans[heroIndex][2]);
-    myUniformLocation = glGetUniformLocation(programID, "objectPosition");            
-    glUniform3f(myUniformLocation,(float)(trans[i][0]),(float)(trans[i][1]),(float)(trans[i][2]));
-    myUniformLocation = glGetUniformLocation(programID, "playerAngle");            
-    glUniform1f(myUniformLocation,varang);
-    draw3DObject(obj);
+    unloadLevel(presentLevel-1);
+    requestLevel(presentLevel+1,LEVEL_Y-LEVEL_DROP);
 }
 
-float dist(float x1,float y1,float z1,float x2,float y2,float z2)
+/* Whether p is beyond the outer edge of a level's floor */
+bool offLevel(glm::vec3 p,const Level &level)
 {
-    int dis=sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2)+(z1-z2)*(z1-z2));
-    return dis;
+    const float half=TILE_SIZE/2;
+    return p[0]<=level.originX-half || p[0]>=level.originX+(level.width-1)*TILE_SIZE+half ||
+           p[2]<=level.originZ-half || p[2]>=level.originZ+(level.depth-1)*TILE_SIZE+half;
 }
 
-int countobj=0;
-glm::vec3 pits[1000];
-glm::vec3 pillars[1000];
-int blocks=10;
-int holes=10;
-int pitCount=0,pillCount=0;
-int pillarHeight=1;
-int objcount=0,Oiterator=0,PillIterator=0;
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
-float rotate_angle=0,ang=0.0f;;
-glm::vec3 rot;
-bool stop=false,stop1=false,coinVanish[1000]={false},coinPos[1000];
-bool rotRight=false,rotLeft=false,rotR=false,rotL=false,level=false;
-int coinStart,prevvarang,backgroundTimer=0,presentLevel=1;
-int pillarsLevel[6],prevPillars=0;
-
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw ()
+/* Stand the hero at the start of a level, a tile and a half in from the corner
+   at the left end of its last row. The hands keep their place beside the body */
+void placeHero(const Level &level)
 {
-    // clear the color and depth in the frame buffer
-    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    // use the loaded shader program
-    // Don't change unless you know what you are doing
-    glUseProgram (programID);
-
-    // Eye - Location of camera. Don't change unless you are sure!!
-    //glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-    //glm::vec3 target (0, 0, 0);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-    //glm::vec3 up (0, 1, 0);
+    glm::vec3 start(level.originX+1.5f*TILE_SIZE,-60.0f,level.originZ+(level.depth-1.5f)*TILE_SIZE);
+    glm::vec3 shift=start-positionOf(heroEntity);
+    Entity parts[]={heroEntity,leftHandEntity,rightHandEntity};
+    for(int p=0;p<3;p++)
+    {
+        int i=slotOf(parts[p]);
+        scene.position[i]+=shift;
+        scene.prevPosition[i]=scene.position[i];
+    }
+}
 
-    //  Don't change unless you are sure!!
-    //eye is position of camera
-    //target is position of object
-    //Matrices.view = glm::lookAt(glm::vec3(300,300,300), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+/* Queue the merged floor of every level that has one, with the object program */
+void queueLevelFloors()
+{
+    for(map<int,Level>::iterator it=levels.begin();it!=levels.end();++it)
+    {
+        const Level &level=it->second;
+        int anchor=slotOf(level.floorAnchor);
+        if(level.floorIndexCount==0 || anchor==-1)
+        {
+            continue;
+        }
+        glm::vec3 origin=scene.drawPosition[anchor];
+        if(!sphereVisible(origin+level.floorCentre,level.floorRadius))
+        {
+            renderStats.culled+=1;
+            continue;
+        }
+        DrawPacket packet;
+        packet.program=&objectPrograms[frameLighting];
+        packet.vertexArray=level.floorArray;
+        packet.fillMode=GL_FILL;
+        packet.overlay=false;
+        packet.primitiveMode=GL_TRIANGLES;
+        packet.indexType=GL_UNSIGNED_INT;
+        packet.firstByte=0;
+        packet.count=level.floorIndexCount;
+        packet.instances=0;
+        packet.model=glm::translate(origin);
+        packet.objectPosition=origin;
+        queuePacket(packet);
+    }
+}
 
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP = Matrices.projection * Matrices.view;
+bool writeBytes(const char* path,const vector<unsigned char>& data)
+{
+    FILE *file=fopen(path, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "Error: could not write %s\n", path);
+        return false;
+    }
+    fwrite(&data[0], 1, data.size(), file);
+    return fclose(file)==0;
+}
 
-    // Send our transformation to the currently bound shader, in the "MVP" uniform
-    // For each model you render, since the MVP will be different (at least the M part)
-    //  Don't change unless you are sure!!
-    glm::mat4 MVP;	// MVP = Projection * View * Model
+int compileLevel(const char* source,const char* output)
+{
+    LevelSource level;
+    vector<unsigned char> data;
+    if(!parseLevelText(source,level))
+    {
+        fprintf(stderr, "Error: could not read %s\n", source);
+        return EXIT_FAILURE;
+    }
+    encodeLevel(level,data);
+    return writeBytes(output,data) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Load identity to model matrix
-    Matrices.model = glm::mat4(1.0f);
-    x=trans[heroIndex][0];
-    y=trans[heroIndex][1];
-    z=trans[heroIndex][2];
-    /* Render your scene */
-    backgroundTimer+=1;
-    //thread(play_audio,"/home/varshit/jump_01.mp3").detach();
-    if(presentLevel==1)
+/* Pack dir/level1.txt, dir/level2.txt, ... up to the first missing one */
+int packLevels(const char* dir,const char* output)
+{
+    vector< vector<unsigned char> > blobs;
+    char path[1024];
+    for(int n=1;;n++)
     {
-        for(int j=0;j<109;j++)
+        LevelSource level;
+        snprintf(path, sizeof(path), "%s/level%d.txt", dir, n);
+        ifstream probe(path);
+        if(!probe.is_open())
         {
-            if(round(trans[heroIndex][0])>trans[j][0]-20 && round(trans[heroIndex][0])<trans[j][0]+20 && round(trans[heroIndex][2])>trans[j][2]-20 && round(trans[heroIndex][2])<trans[j][2]+20)
-            {
-                objects[j]=createCube(20.0f,51.0f/255.0,133.0f/255.0,1.0f);
-            }
-            else
-            {
-                objects[j]=createCube(20.0f,1.0f,1.0f,0.0f);
-            }
+            break;
         }
-    }
-    if(presentLevel==2)
-    {
-        for(int j=109;j<219;j++)
+        if(!parseLevelText(path,level))
         {
-            if(round(trans[heroIndex][0])>trans[j][0]-20 && round(trans[heroIndex][0])<trans[j][0]+20 && round(trans[heroIndex][2])>trans[j][2]-20 && round(trans[heroIndex][2])<trans[j][2]+20)
-            {
-                objects[j]=createCube(20.0f,51.0f/255.0,133.0f/255.0,1.0f);
-            }
-            else
-            {
-                objects[j]=createCube(20.0f,1.0f,1.0f,0.0f);
-            }
+            return EXIT_FAILURE;
         }
+        blobs.pb(vector<unsigned char>());
+        encodeLevel(level,blobs.back());
     }
-    if(jumpFlag)
+
+    vector<unsigned char> pack;
+    pack.insert(pack.end(), "LPK1", "LPK1"+4);
+    putLE(pack, blobs.size(), 4);
+    size_t offset=8+8*blobs.size();
+    for(int b=0;b<(int)blobs.size();b++)
     {
-        timer+=1;
+        putLE(pack, offset, 4);
+        putLE(pack, blobs[b].size(), 4);
+        offset=(offset+blobs[b].size()+3)&~(size_t)3;
     }
-    else
+    for(int b=0;b<(int)blobs.size();b++)
     {
-        timer=0;
+        pack.insert(pack.end(), blobs[b].begin(), blobs[b].end());
+        pack.resize((pack.size()+3)&~(size_t)3, 0);
     }
-    if(timer%60==1)
+    printf("Packed %d levels into %s\n", (int)blobs.size(), output);
+    return writeBytes(output,pack) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Simulation rate - gameplay speed no longer depends on the frame rate
+#define TICK_RATE 120
+#define TICK_SECONDS (1.0/TICK_RATE)
+
+/* Advance the game by one fixed step of TICK_SECONDS */
+void update ()
+{
+    scene.prevPosition=scene.position;
+    scene.prevRotation=scene.rotation;
+    prevVarang=varang;
+    glm::vec3 &hero=positionOf(heroEntity),&leftHand=positionOf(leftHandEntity),&rightHand=positionOf(rightHandEntity);
+    float &leftSwing=rotationOf(leftHandEntity),&rightSwing=rotationOf(rightHandEntity);
+
+    backgroundTimer+=1;
+    updateTileHighlight();
+    if(jumpFlag)
     {
-        thread(play_audio,"nitro.mp3").detach();
+        timer+=1;
     }
-    if(backgroundTimer%(142*60)==1)
+    else
     {
-        thread(play_audio,"background.mp3").detach();
+        timer=0;
     }
-    if(jumpFlag && trans[heroIndex][1]<=-20)
+    if(timer%(TICK_RATE)==1)
     {
-        trans[heroIndex][1]+=0.8;
-        trans[leftHandIndex][1]+=0.8;
-        trans[rightHandIndex][1]+=0.8;
+        playSound("nitro.mp3");
     }
-    if(!jumpFlag && trans[heroIndex][1]>-60)
+    if(backgroundTimer%(142*TICK_RATE)==1)
     {
-        trans[heroIndex][1]-=0.8;
-        trans[leftHandIndex][1]-=0.8;
-        trans[rightHandIndex][1]-=0.8;
+        playSound("background.mp3");
     }
-    if(Oiterator==pitCount)
+    if(jumpFlag && hero[1]<=-20)
     {
-        Oiterator=0;
+        hero[1]+=0.4;
+        leftHand[1]+=0.4;
+        rightHand[1]+=0.4;
     }
-    if(PillIterator==pillarsLevel[presentLevel])
+    if(!jumpFlag && hero[1]>-60)
     {
-        PillIterator=prevPillars;
+        hero[1]-=0.4;
+        leftHand[1]-=0.4;
+        rightHand[1]-=0.4;
     }
-    if(trans[heroIndex][0]<=pits[Oiterator][0]+20 && trans[heroIndex][0]>=pits[Oiterator][0]-20 && trans[heroIndex][2]<=pits[Oiterator][2]+20 && trans[heroIndex][2]>=pits[Oiterator][2]-20 && !fall)
+    if(!fall && overPit(hero,presentLevel))
     {
-        fall=true;
-        level=true;
-        prevPillars=pillarsLevel[presentLevel];
-        presentLevel+=1;
-        PillIterator=prevPillars;
+        // Normally long since built, but the hero may have been quick
+        finishLevel(presentLevel+1);
+        // The pits of the last level have nothing below them
+        if(levels.count(presentLevel+1))
+        {
+            fall=true;
+            level=true;
+            presentLevel+=1;
+        }
     }
     if(fall)
     {
         if(level)
         {
-            for(int i=0;i<109;i++)
+            // Everything rises until the new level is where the old one was
+            for(int i=0;i<entityCount();i++)
             {
-                trans[i][1]+=1;
+                scene.position[i][1]+=0.5;
             }
-            for(int j=109;j<226;j++)
+            for(map<int,Level>::iterator it=levels.begin();it!=levels.end();++it)
             {
-                if(trans[110][1]==-100)
-                {
-                    level=false;
-                }
-                trans[j][1]+=1;
+                it->second.y+=0.5;
+            }
+            if(levels[presentLevel].y==LEVEL_Y)
+            {
+                level=false;
+                fall=false;
+                finishLevelChange();
             }
         }
-        //trans[heroIndex][1]-=1;
-        //trans[leftHandIndex][1]-=1;
-        //trans[rightHandIndex][1]-=1;
+        //hero[1]-=1;
+        //leftHand[1]-=1;
+        //rightHand[1]-=1;
     }
-    if(trans[heroIndex][0]<=-200 || trans[heroIndex][0]>=200 || trans[heroIndex][2]<=-200 || trans[heroIndex][2]>=200)
+    if(offLevel(hero,levels[presentLevel]))
     {
-        trans[heroIndex][1]-=0.5;   
-        trans[leftHandIndex][1]-=0.5;   
-        trans[rightHandIndex][1]-=0.5;   
+        hero[1]-=0.25;
+        leftHand[1]-=0.25;
+        rightHand[1]-=0.25;
     }
-    float pillX=trans[heroIndex][0]-pillars[PillIterator][0];
-    float pillY=trans[heroIndex][1]-pillars[PillIterator][1];
-    float pillZ=trans[heroIndex][2]-pillars[PillIterator][2];
-    float distance=sqrt((pillX*pillX)+(pillY*pillY)+(pillZ*pillZ));
     if(upFlag)
     {
-        if(!stop)
-        {
-            trans[heroIndex][2]-=0.3*cos(varang*(M_PI/180));
-            trans[heroIndex][0]-=0.3*sin(varang*(M_PI/180));
-            trans[rightHandIndex][0]-=0.3*sin(varang*(M_PI/180));
-            trans[rightHandIndex][2]-=0.3*cos(varang*(M_PI/180));
-            trans[leftHandIndex][0]-=0.3*sin(varang*(M_PI/180));
-            trans[leftHandIndex][2]-=0.3*cos(varang*(M_PI/180));
-        }
-        if(!jumpFlag && !stop)
+        bool moved=moveHero(glm::vec3(-0.15*sin(varang*(M_PI/180)),0,-0.15*cos(varang*(M_PI/180))));
+        if(!jumpFlag && moved)
         {
-            if(rotat[rightHandIndex]<30 && !rotRight)
+            if(rightSwing<30 && !rotRight)
             {
-                rotat[rightHandIndex]+=1.0f;
+                rightSwing+=0.5f;
             }
-            if(rotat[rightHandIndex]>=30)
+            if(rightSwing>=30)
             {
                 rotRight=true;
             }
             if(rotRight)
             {
-                rotat[rightHandIndex]-=1.0f;
+                rightSwing-=0.5f;
             }
-            if(rotat[rightHandIndex]<=-30)
+            if(rightSwing<=-30)
             {
                 rotRight=false;
             }
-            if(rotat[leftHandIndex]>=-30 && !rotLeft)
+            if(leftSwing>=-30 && !rotLeft)
             {
-                rotat[leftHandIndex]-=1.0f;
+                leftSwing-=0.5f;
             }
-            if(rotat[leftHandIndex]<=-30)
+            if(leftSwing<=-30)
             {
                 rotLeft=true;
             }
             if(rotLeft)
             {
-                rotat[leftHandIndex]+=1.0f;
+                leftSwing+=0.5f;
             }
-            if(rotat[leftHandIndex]>=30)
+            if(leftSwing>=30)
             {
                 rotLeft=false;
             }
         }
     }
-    if(downFlag && !stop1 && !jumpFlag)
+    if(downFlag && !jumpFlag)
     {
-        if(!stop)
-        {
-            trans[heroIndex][2]+=0.3*cos(varang*(M_PI/180));
-            trans[heroIndex][0]+=0.3*sin(varang*(M_PI/180));
-            trans[rightHandIndex][0]+=0.3*sin(varang*(M_PI/180));
-            trans[rightHandIndex][2]+=0.3*cos(varang*(M_PI/180));
-            trans[leftHandIndex][0]+=0.3*sin(varang*(M_PI/180));
-            trans[leftHandIndex][2]+=0.3*cos(varang*(M_PI/180));
-        }
-        if(!jumpFlag && !stop)
+        bool moved=moveHero(glm::vec3(0.15*sin(varang*(M_PI/180)),0,0.15*cos(varang*(M_PI/180))));
+        if(moved)
         {
-            if(rotat[rightHandIndex]>=-30 && !rotR)
+            if(rightSwing>=-30 && !rotR)
             {
-                rotat[rightHandIndex]-=1.0f;
+                rightSwing-=0.5f;
             }
-            if(rotat[rightHandIndex]<=-30)
+            if(rightSwing<=-30)
             {
                 rotR=true;
             }
             if(rotR)
             {
-                rotat[rightHandIndex]+=1.0f;
+                rightSwing+=0.5f;
             }
-            if(rotat[rightHandIndex]>=30)
+            if(rightSwing>=30)
             {
                 rotR=false;
             }
-            if(rotat[leftHandIndex]<=30 && !rotL)
+            if(leftSwing<=30 && !rotL)
             {
-                rotat[leftHandIndex]+=1.0f;
+                leftSwing+=0.5f;
             }
-            if(rotat[leftHandIndex]>=30)
+            if(leftSwing>=30)
             {
                 rotL=true;
             }
             if(rotL)
             {
-                rotat[leftHandIndex]-=1.0f;
+                leftSwing-=0.5f;
             }
-            if(rotat[leftHandIndex]<=-30)
+            if(leftSwing<=-30)
             {
                 rotL=false;
             }
         }
     }
-    for(int i=0;i<objcount;i++)
-    {
-        if(i==leftHandIndex || i==rightHandIndex)
-        {
-            rot=glm::vec3(1,0,0);
-        }
-        else
-        {
-            rot=glm::vec3(0,1,0);
-        }
-        if(i!=heroIndex && i!=leftHandIndex && i!=rightHandIndex)
-        {
-            if(coinVanish[i])
-            {
-                continue;
-            }
-            drawobject(objects[i],trans[i],rotat[i],rot,i);
-        }
-        else
-        {
-            if(leftFlag)
-            {
-                drawHero(objects[i],trans[i],rotat[i],rot,trans[heroIndex]);
-                varang+=1;
-            }
-            if(rightFlag)
-            {
-                drawHero(objects[i],trans[i],rotat[i],rot,trans[heroIndex]);
-                varang-=1;
-            }
-            if(!leftFlag || !rightFlag)
-            {
-                drawHero(objects[i],trans[i],rotat[i],rot,trans[heroIndex]);
-            }
-        }  
-    }
-    if(distance<=52)
+    // Turning used to happen once per hero part drawn, 3 degrees per frame
+    if(leftFlag)
     {
-        prevvarang=0;
-        stop=true;
+        varang+=1.5;
     }
-    if(varang>prevvarang)
+    if(rightFlag)
     {
-        stop=false;
+        varang-=1.5;
     }
-    for(int j=coinStart;j<objcount;j++)
+    for(int j=0;j<entityCount();j++)
     {
-        rotat[j]+=0.5;
-        if(trans[heroIndex][0]>=trans[j][0] && trans[heroIndex][0]<=trans[j][0]+20 && trans[heroIndex][2]<=trans[j][2]+20 && trans[heroIndex][2]>=trans[j][2]-20)
+        if(!(scene.flags[j]&ENTITY_COIN))
         {
-            //thread(play_audio,"/home/varshit/Downloads/coin.mp3").detach();
-            coinVanish[j]=true;
+            continue;
         }
+        scene.rotation[j]+=0.25;
     }
-    Oiterator+=1;
-    PillIterator+=1;
-    //drawobject(objects[objcount-2],trans[objcount-2],0.0f,glm::vec3(0,1,0));
-    //drawobject(objects[objcount-1],trans[objcount-1],rotate_angle,glm::vec3(1,0,0));
+    collectCoins(hero,presentLevel);
     // Increment angles
     float increments = 1;
 
@@ -1179,57 +3599,88 @@ void draw ()
     triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
     rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
     countobj+=1;
-    prevvarang=varang;
 }
 
-void createMap(int platform[][12],float yPos,int yourLevel)
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+void draw (float alpha,float elapsed)
 {
-    int presentPillars=0;
-    float numY=yPos;
-    for(int k=0;k<1;k++)
+    // clear the color and depth in the frame buffer
+    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    reloadShaders();
+    renderStats.drawCalls = 0;
+    renderStats.triangles = 0;
+    renderStats.stateChanges = 0;
+
+    // Eye - Location of camera. Don't change unless you are sure!!
+    //glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+    // Target - Where is the camera looking at.  Don't change unless you are sure!!
+    //glm::vec3 target (0, 0, 0);
+    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+    //glm::vec3 up (0, 1, 0);
+
+    //  Don't change unless you are sure!!
+    //eye is position of camera
+    //target is position of object
+    //Matrices.view = glm::lookAt(glm::vec3(300,300,300), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+
+    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+    //  Don't change unless you are sure!!
+    glm::mat4 VP = Matrices.projection * Matrices.view;
+
+    // Send our transformation to the currently bound shader, in the "MVP" uniform
+    // For each model you render, since the MVP will be different (at least the M part)
+    //  Don't change unless you are sure!!
+    glm::mat4 MVP;	// MVP = Projection * View * Model
+
+    // Load identity to model matrix
+    Matrices.model = glm::mat4(1.0f);
+    // Bring in a slice of any level the loader has ready, before anything is drawn
+    streamLevels(LEVEL_SLICE);
+
+    // Blend the last two simulation steps so motion stays smooth between ticks
+    int n=entityCount();
+    for(int i=0;i<n;i++)
+    {
+        scene.drawPosition[i]=glm::mix(scene.prevPosition[i],scene.position[i],alpha);
+        scene.drawRotation[i]=scene.prevRotation[i]+(scene.rotation[i]-scene.prevRotation[i])*alpha;
+    }
+    drawVarang=prevVarang+(varang-prevVarang)*alpha;
+    glm::vec3 hero=scene.drawPosition[slotOf(heroEntity)];
+    x=hero[0];
+    y=hero[1];
+    z=hero[2];
+    /* Render your scene */
+    updateCamera(elapsed);
+    updateFrameUniforms();
+    cullScene();
+    for(int i=0;i<n;i++)
     {
-        float numZ=-200.0f;
-        for(int i=0;i<blocks;i++)
+        int flags=scene.flags[i];
+        if(flags&ENTITY_LIMB)
         {
-            float numX=-200.0f;
-            for(int j=0;j<11;j++)
-            {
-                //floor
-                if(platform[i][j]==1)
-                {
-                    objects[objcount]=createCube(20.0f,1.0f,1.0f,0.0f);
-                    trans[objcount]=glm::vec3(numX,numY,numZ);
-                    rotat[objcount]=0.0f;
-                    objcount+=1;
-                }
-                //pillars
-                if(platform[i][j]==2)
-                {
-                    float pillarY=numY+40.0f;
-                    for(int l=0;l<pillarHeight;l++)
-                    {
-                        objects[objcount]=createCube(20.0f,1.0f,1.0f,0.0f);
-                        trans[objcount]=glm::vec3(numX,pillarY,numZ);
-                        rotat[objcount]=0.0f;
-                        objcount+=1;
-                        pillarY+=40.0f;
-                    }
-                    pillars[pillCount]=glm::vec3(numX,pillarY,numZ);
-                    pillCount+=1;
-                    presentPillars+=1;
-                }
-                else if(platform[i][j]==0)
-                {
-                    pits[pitCount]=glm::vec3(numX,numY,numZ);
-                    pitCount+=1;
-                }
-                numX+=40.0f;
-            }
-            numZ+=40.0f;
+            rot=glm::vec3(1,0,0);
+        }
+        else
+        {
+            rot=glm::vec3(0,1,0);
+        }
+        if(flags&ENTITY_HERO_PART)
+        {
+            drawHero(scene.mesh[i],scene.drawPosition[i],scene.drawRotation[i],rot,hero);
+        }
+        else if(!(flags&(ENTITY_HIDDEN|ENTITY_INSTANCED)) && entityVisible[i])
+        {
+            drawobject(scene.mesh[i],scene.drawPosition[i],scene.drawRotation[i],rot,i);
         }
-        numY+=40.0f;
     }
-    pillarsLevel[yourLevel]=presentPillars;
+    queueLevelFloors();
+    queueBatches();
+    flushRenderQueue();
+
+    // Whatever was let go of this frame can be deleted now that nothing draws with it
+    flushGpuGarbage();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1281,6 +3732,106 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Offscreen rendering without a window or display, for CI and render farms */
+struct Headless {
+    bool enabled;
+    int frames;             // frames to render before exiting
+    const char* dumpDir;    // write every frame here as PPM, NULL to skip
+    GpuHandle Framebuffer;
+    GpuHandle ColorRenderbuffer;
+    GpuHandle DepthRenderbuffer;
+#ifdef __linux__
+    EGLDisplay display;
+    EGLContext context;
+#endif
+} headless = { false, 600, NULL };
+
+/* Create a surfaceless EGL context (Mesa software rendering works) and an FBO to draw into */
+void initHeadless (int width, int height)
+{
+#ifdef __linux__
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay)
+        headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (headless.display == EGL_NO_DISPLAY)
+        headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (!eglInitialize(headless.display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "Error: could not initialise EGL (0x%x)\n", eglGetError());
+        exit(EXIT_FAILURE);
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.context = eglCreateContext(headless.display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
+    if (headless.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context)) {
+        fprintf(stderr, "Error: could not create a surfaceless OpenGL 3.3 context (0x%x)\n", eglGetError());
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // Everything is drawn into this framebuffer instead of a window
+    headless.Framebuffer = genFramebuffer();
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.Framebuffer);
+    headless.ColorRenderbuffer = genRenderbuffer();
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.ColorRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.ColorRenderbuffer);
+    headless.DepthRenderbuffer = genRenderbuffer();
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.DepthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.DepthRenderbuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Error: offscreen framebuffer is incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+#else
+    fprintf(stderr, "Error: headless mode needs EGL, which this platform does not have\n");
+    exit(EXIT_FAILURE);
+#endif
+}
+
+void quitHeadless ()
+{
+    headless.Framebuffer.reset();
+    headless.ColorRenderbuffer.reset();
+    headless.DepthRenderbuffer.reset();
+    flushGpuGarbage();
+#ifdef __linux__
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+#endif
+}
+
+/* Save the offscreen framebuffer as a binary PPM, flipped so row 0 is the top */
+void writeFrame (const char* dir, int frame, int width, int height)
+{
+    vector<unsigned char> pixels(3*width*height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/frame_%05d.ppm", dir, frame);
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: could not write %s\n", path);
+        return;
+    }
+    fprintf(out, "P6\n%d %d\n255\n", width, height);
+    for (int row = height-1; row >= 0; row--)
+        fwrite(&pixels[3*width*row], 1, 3*width, out);
+    fclose(out);
+}
+
 int cnt;
 
 /* Initialize the OpenGL rendering properties */
@@ -1289,93 +3840,59 @@ void initGL (GLFWwindow* window, int width, int height)
 {
     /* Objects should be created before any other gl function and shaders */
     // Create the models
-    //createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
+    //createTriangle (); // Add the triangle to the shared mesh buffers
     //send half length of side
-    createMap(platform1,-100,1);
-    createMap(platform2,-400,2);
-
-    //Hero
-    objects[objcount]=createCube(5.0f,1.0f,1.0f,0.0f);
-    trans[objcount]=glm::vec3(-140.0f,-60.0f,140.0f);
-    heroIndex=objcount;
-    rotat[objcount]=0.0f;
-    objcount+=1;
+    //Every floor tile and pillar segment shares this cube
+    cube=createCube(20.0f,1.0f,1.0f,0.0f);
+    floorBatch=createBatch(cube);
+    pillarBatch=createBatch(cube);
+    // With merged floors only the highlighted tile is drawn, over the level mesh
+    batches[floorBatch].overlay=meshFloors;
+
+    //Hero, put on its level once that is loaded
+    heroEntity=createEntity(createCube(5.0f,1.0f,1.0f,0.0f),glm::vec3(0.0f,-60.0f,0.0f),ENTITY_HERO_PART,0);
     //Hero righthand
-    objects[objcount]=createCuboid(5.0f,15.0f,5.0f);
-    trans[objcount]=glm::vec3(-130.0f,-65.0f,140.0f);
-    rightHandIndex=objcount;
-    rotat[objcount]=0.0f;
-    objcount+=1;
+    rightHandEntity=createEntity(createCuboid(5.0f,15.0f,5.0f),glm::vec3(10.0f,-65.0f,0.0f),ENTITY_HERO_PART|ENTITY_LIMB,0);
     //Hero left hand
-    objects[objcount]=createCuboid(5.0f,15.0f,5.0f);
-    trans[objcount]=glm::vec3(-150.0f,-65.0f,140.0f);
-    leftHandIndex=objcount;
-    rotat[objcount]=0.0f;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(20,40);
-    trans[objcount]=glm::vec3(200.0f,-80.0f,160.0f);
-    rotat[objcount]=0.0f;
-    //coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(20,40);
-    trans[objcount]=glm::vec3(200.0f,-80.0f,-200.0f);
-    rotat[objcount]=0.0f;
-    //coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(20,40);
-    trans[objcount]=glm::vec3(-200.0f,-80.0f,-200.0f);
-    rotat[objcount]=0.0f;
-    //coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(20,40);
-    trans[objcount]=glm::vec3(-200.0f,-80.0f,160.0f);
-    rotat[objcount]=0.0f;
-    //coinPos[objcount]=1;
-    objcount+=1;
-
-    //Coins
-    objects[objcount]=createPyramid(10,20);
-    trans[objcount]=glm::vec3(-100.0f,-80.0f,140.0f);
-    rotat[objcount]=0.0f;
-    coinPos[objcount]=1;
-    coinStart=objcount;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(10,20);
-    trans[objcount]=glm::vec3(-50.0f,-80.0f,140.0f);
-    rotat[objcount]=0.0f;
-    coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(10,20);
-    trans[objcount]=glm::vec3(0.0f,-80.0f,140.0f);
-    rotat[objcount]=0.0f;
-    coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(10,20);
-    trans[objcount]=glm::vec3(50.0f,-80.0f,140.0f);
-    rotat[objcount]=0.0f;
-    coinPos[objcount]=1;
-    objcount+=1;
-
-    objects[objcount]=createPyramid(10,20);
-    trans[objcount]=glm::vec3(100.0f,-80.0f,140.0f);
-    rotat[objcount]=0.0f;
-    coinPos[objcount]=1;
-    objcount+=1;
-
-    // Create and compile our GLSL program from the shaders
-    // Create and compile our GLSL program from the shaders
-
-    // Create and compile our GLSL program from the shaders
-    programID = LoadShaders( "TextureRender.vert","TextureRender.frag" );
-    // Get a handle for our "MVP" uniform
-    Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+    leftHandEntity=createEntity(createCuboid(5.0f,15.0f,5.0f),glm::vec3(-10.0f,-65.0f,0.0f),ENTITY_HERO_PART|ENTITY_LIMB,0);
+
+    cornerPyramid=createPyramid(20,40);
+    coinPyramid=createPyramid(10,20);
+    cornerBatch=createBatch(cornerPyramid);
+    coinBatch=createBatch(coinPyramid);
+
+    // The level being played and the one below it
+    openLevelPack("levels/levels.pack");
+    startLevelLoader();
+    requestLevel(presentLevel,LEVEL_Y);
+    requestLevel(presentLevel+1,LEVEL_Y-LEVEL_DROP);
+    finishLevel(presentLevel);
+    if(!levels.count(presentLevel))
+    {
+        fprintf(stderr, "Error: could not load level %d from levels/\n", presentLevel);
+        stopThreads();
+        exit(EXIT_FAILURE);
+    }
+    placeHero(levels[presentLevel]);
+
+    // Create and compile our GLSL programs from the shaders
+    for(int s=0;s<SHADER_SLOTS;s++)
+    {
+        *shaderSlots[s].program = createShaderProgram(shaderSlots[s].vertexPath, shaderSlots[s].fragmentPath, shaderSlots[s].variant);
+        if(!shaderSlots[s].program->ProgramID)
+        {
+            stopThreads();
+            exit(EXIT_FAILURE);
+        }
+    }
+    uploadMeshes();
+    uploadBatches();
+
+    // Per-frame uniforms live in one buffer shared by both programs
+    frameUniformBuffer = genBuffer();
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, frameUniformBuffer);
 
 
     reshapeWindow (window, width, height);
@@ -1393,94 +3910,277 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* One key press or release of the benchmark session, at a simulated 60 fps */
+struct ScriptEvent {
+    int frame;
+    int key;
+    int action;
+};
+
+const ScriptEvent benchmarkScript[] = {
+    // Walk level 1 straight into the pit
+    {    0, GLFW_KEY_UP, GLFW_PRESS },
+    {  360, GLFW_KEY_UP, GLFW_RELEASE },
+    // Level 2 rises into place, then walk around it and jump
+    {  680, GLFW_KEY_DOWN, GLFW_PRESS },
+    {  800, GLFW_KEY_DOWN, GLFW_RELEASE },
+    {  800, GLFW_KEY_LEFT, GLFW_PRESS },
+    {  830, GLFW_KEY_LEFT, GLFW_RELEASE },
+    {  830, GLFW_KEY_UP, GLFW_PRESS },
+    {  840, GLFW_KEY_SPACE, GLFW_PRESS },
+    {  900, GLFW_KEY_SPACE, GLFW_RELEASE },
+    {  950, GLFW_KEY_UP, GLFW_RELEASE },
+    // Every camera mode in turn
+    {  960, GLFW_KEY_Z, GLFW_PRESS },
+    { 1080, GLFW_KEY_Z, GLFW_RELEASE },
+    { 1080, GLFW_KEY_X, GLFW_PRESS },
+    { 1200, GLFW_KEY_X, GLFW_RELEASE },
+    { 1200, GLFW_KEY_T, GLFW_PRESS },
+    { 1260, GLFW_KEY_T, GLFW_RELEASE },
+    { 1260, GLFW_KEY_F, GLFW_PRESS },
+    { 1320, GLFW_KEY_F, GLFW_RELEASE },
+    { 1320, GLFW_KEY_H, GLFW_PRESS },
+    { 1380, GLFW_KEY_H, GLFW_RELEASE },
+};
+#define BENCHMARK_SCRIPT_FRAMES 1440
+
+double percentile (const vector<double>& sorted, double p)
+{
+    int index = (int)ceil(p*sorted.size()) - 1;
+    return sorted[min(max(index, 0), (int)sorted.size()-1)];
+}
+
+/* Play the scripted session without vsync and report frame times as JSON */
+// When the process started, to time how long the first frame takes to appear
+chrono::steady_clock::time_point processStart;
+
+void runBenchmark (GLFWwindow* window, int frames, const char* outputPath)
+{
+    vector<double> frameTimes;
+    double firstFrameMs = 0;
+    double drawCallsTotal = 0, trianglesTotal = 0, culledTotal = 0, stateChangesTotal = 0;
+    int drawCallsMax = 0;
+    long trianglesMax = 0;
+    frameTimes.reserve(frames);
+
+    if (window)
+        glfwSwapInterval(0);
+
+    int scriptLength = sizeof(benchmarkScript)/sizeof(benchmarkScript[0]);
+    int next = 0;
+    double accumulator = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        while (next < scriptLength && benchmarkScript[next].frame <= frame) {
+            keyboard(window, benchmarkScript[next].key, 0, benchmarkScript[next].action, 0);
+            next++;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        accumulator += 1.0/60;
+        while (accumulator >= TICK_SECONDS) {
+            update();
+            accumulator -= TICK_SECONDS;
+        }
+        draw(accumulator/TICK_SECONDS, 1.0/60);
+        if (window) {
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+        // Count the time the (possibly software) renderer needs to finish the frame too
+        glFinish();
+        frameTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        if (frame == 0)
+            firstFrameMs = chrono::duration<double, milli>(chrono::steady_clock::now() - processStart).count();
+
+        drawCallsTotal += renderStats.drawCalls;
+        trianglesTotal += renderStats.triangles;
+        culledTotal += renderStats.culled;
+        stateChangesTotal += renderStats.stateChanges;
+        drawCallsMax = max(drawCallsMax, renderStats.drawCalls);
+        trianglesMax = max(trianglesMax, renderStats.triangles);
+    }
+    // Joining the audio thread makes its numbers final
+    bool audioRan = audio.running;
+    stopAudio();
+
+    vector<double> sorted(frameTimes);
+    sort(sorted.begin(), sorted.end());
+    double mean = 0;
+    for (int i = 0; i < frames; i++)
+        mean += frameTimes[i];
+    mean /= frames;
+
+    FILE* out = outputPath ? fopen(outputPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: could not write %s\n", outputPath);
+        stopThreads();
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+    fprintf(out, "  \"frames\": %d,\n", frames);
+    fprintf(out, "  \"first_frame_ms\": %.3f,\n", firstFrameMs);
+    fprintf(out, "  \"frame_ms\": { \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+            sorted.front(), mean, percentile(sorted, 0.5), percentile(sorted, 0.99), sorted.back());
+    fprintf(out, "  \"draw_calls\": { \"mean\": %.1f, \"max\": %d },\n", drawCallsTotal/frames, drawCallsMax);
+    fprintf(out, "  \"culled\": { \"mean\": %.1f },\n", culledTotal/frames);
+    fprintf(out, "  \"state_changes\": { \"mean\": %.1f },\n", stateChangesTotal/frames);
+    fprintf(out, "  \"gpu_objects\": { \"live\": %ld, \"created\": %ld },\n", gpuStats.created-gpuStats.deleted, gpuStats.created);
+    fprintf(out, "  \"triangles\": { \"mean\": %.1f, \"max\": %ld }%s\n", trianglesTotal/frames, trianglesMax, audioRan ? "," : "");
+    if (audioRan) {
+        // Block time is how long a block takes to hear, mix time how long it took to make
+        const AudioStats& stats = audio.stats;
+        fprintf(out, "  \"audio\": { \"blocks\": %ld, \"block_ms\": %.3f, \"mix_ms\": { \"mean\": %.3f, \"max\": %.3f }, "
+                     "\"triggers\": %ld, \"trigger_latency_ms\": { \"mean\": %.3f, \"max\": %.3f } }\n",
+                stats.blocks, 1000.0*AUDIO_MIX_FRAMES/AUDIO_RATE,
+                stats.blocks ? stats.mixMs/stats.blocks : 0.0, stats.mixMaxMs,
+                stats.triggers, stats.triggers ? stats.latencyMs/stats.triggers : 0.0, stats.latencyMaxMs);
+    }
+    fprintf(out, "}\n");
+    if (out != stdout)
+        fclose(out);
+}
+
+void usage (const char* program)
+{
+    fprintf(stderr, "usage: %s [--headless] [--frames N] [--dump-frames DIR] [--size WxH]\n"
+                    "          [--benchmark] [--bench-output FILE] [--audio ao|null|none|wav:FILE]\n"
+                    "          [--mesh-floors] [--watch-shaders]\n"
+                    "       %s --compile-level SOURCE.txt OUTPUT.lvl\n"
+                    "       %s --pack-levels DIR OUTPUT.pack\n", program, program, program);
+    exit(EXIT_FAILURE);
+}
+
 int main (int argc, char** argv)
 {
+    processStart = chrono::steady_clock::now();
     int width = 800;
     int height = 600;
+    int frames = 0;
+    bool benchmark = false;
+    const char* benchOutput = NULL;
+    const char* audioSink = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless"))
+            headless.enabled = true;
+        else if (!strcmp(argv[i], "--frames") && i+1 < argc)
+            frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--benchmark"))
+            benchmark = true;
+        else if (!strcmp(argv[i], "--bench-output") && i+1 < argc)
+            benchOutput = argv[++i];
+        else if (!strcmp(argv[i], "--dump-frames") && i+1 < argc)
+            headless.dumpDir = argv[++i];
+        else if (!strcmp(argv[i], "--compile-level") && i+2 < argc)
+            return compileLevel(argv[i+1], argv[i+2]);
+        else if (!strcmp(argv[i], "--pack-levels") && i+2 < argc)
+            return packLevels(argv[i+1], argv[i+2]);
+        else if (!strcmp(argv[i], "--mesh-floors"))
+            meshFloors = true;
+        else if (!strcmp(argv[i], "--watch-shaders"))
+            watchShaders = true;
+        else if (!strcmp(argv[i], "--audio") && i+1 < argc)
+            audioSink = argv[++i];
+        else if (!strcmp(argv[i], "--size") && i+1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2)
+                usage(argv[0]);
+        }
+        else
+            usage(argv[0]);
+    }
+    if (frames > 0)
+        headless.frames = frames;
+
+    // Headless machines usually have no sound device, so they stay silent unless asked
+    audio.sink.type = headless.enabled ? AUDIO_SINK_NONE : AUDIO_SINK_LIBAO;
+    if (audioSink) {
+        if (!strcmp(audioSink, "ao"))
+            audio.sink.type = AUDIO_SINK_LIBAO;
+        else if (!strcmp(audioSink, "null"))
+            audio.sink.type = AUDIO_SINK_NULL;
+        else if (!strcmp(audioSink, "none"))
+            audio.sink.type = AUDIO_SINK_NONE;
+        else if (!strncmp(audioSink, "wav:", 4) && audioSink[4]) {
+            audio.sink.type = AUDIO_SINK_WAV;
+            audio.sink.path = audioSink+4;
+        }
+        else
+            usage(argv[0]);
+    }
 
-    GLFWwindow* window = initGLFW(width, height);
-    //Map
-    for(int i=0;i<11;i++)
-    {
-        for(int j=0;j<12;j++)
-        {
-            platform1[i][j]=1;
-        }
-    }
-    for(int i=0;i<11;i++)
-    {
-        for(int j=0;j<12;j++)
-        {
-            platform2[i][j]=1;
-        }
-    }
-    //Pits
-    platform1[6][1]=0;
-    // Walls
-    platform1[2][3]=2;
-    platform1[2][4]=2;
-    platform1[2][5]=2;
-    platform1[2][6]=2;
-    platform1[2][7]=2;
-    platform1[2][8]=2;
-    platform1[3][5]=2;
-    platform1[4][5]=2;
-    platform1[5][5]=2;
-    platform1[7][2]=1;
-    platform1[6][2]=1;
-    platform1[5][2]=1;
-    platform1[4][2]=1;
-    platform1[3][2]=1;
-    platform1[2][2]=2;
-    platform1[3][8]=2;
-    platform1[4][8]=2;
-    platform1[5][8]=2;
-    platform1[6][8]=2;
-    platform1[7][8]=2;
-    //Level 2
-    platform2[2][3]=2;
-    platform2[2][4]=2;
-    platform2[2][5]=2;
-    platform2[2][6]=2;
-    platform2[2][7]=2;
-    platform2[2][8]=2;
-    platform2[3][5]=2;
-    platform2[4][5]=2;
-    platform2[5][5]=2;
-    platform2[7][2]=2;
-    platform2[6][2]=2;
-    platform2[5][2]=2;
-    platform2[4][2]=2;
-    platform2[3][2]=2;
-    platform2[2][2]=2;
-    platform2[3][8]=2;
-    platform2[4][8]=2;
-    platform2[5][8]=2;
-    platform2[6][8]=2;
-    platform2[7][8]=2;
-    //Walls
+    GLFWwindow* window = NULL;
+    if (headless.enabled)
+        initHeadless(width, height);
+    else
+        window = initGLFW(width, height);
     initGL (window, width, height);
-    objects[objcount-1]->ColorBuffer=0;
-    double last_update_time = glfwGetTime(), current_time;
+
+    // Shaders reload as they are edited in a window, and when asked for headless
+    if (watchShaders || !headless.enabled)
+        startShaderWatcher();
+    if (audio.sink.type != AUDIO_SINK_NONE)
+    {
+        // Short effects are decoded once up front, the background track is streamed
+        audio.preload.push_back("nitro.mp3");
+        startAudio();
+    }
+
+    if (benchmark) {
+        runBenchmark(window, frames > 0 ? frames : BENCHMARK_SCRIPT_FRAMES, benchOutput);
+        stopThreads();
+        if (headless.enabled)
+            quitHeadless();
+        else
+            glfwTerminate();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (headless.enabled) {
+        // Simulate a steady 60 fps, as fast as the machine can render it
+        double accumulator = 0;
+        for (int frame = 0; frame < headless.frames; frame++) {
+            accumulator += 1.0/60;
+            while (accumulator >= TICK_SECONDS) {
+                update();
+                accumulator -= TICK_SECONDS;
+            }
+            draw(accumulator/TICK_SECONDS, 1.0/60);
+            if (headless.dumpDir)
+                writeFrame(headless.dumpDir, frame, width, height);
+        }
+        glFinish();
+        stopThreads();
+        quitHeadless();
+        exit(EXIT_SUCCESS);
+    }
+
+    double last_frame_time = glfwGetTime(), current_time;
+    double accumulator = 0;
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
-        // OpenGL Draw commands
-        draw();
+        // Run as many fixed simulation steps as the elapsed time asks for
+        current_time = glfwGetTime(); // Time in seconds
+        double elapsed = min(current_time - last_frame_time, 0.25); // don't try to catch up after a long stall
+        last_frame_time = current_time;
+        accumulator += elapsed;
+        while (accumulator >= TICK_SECONDS) {
+            update();
+            accumulator -= TICK_SECONDS;
+        }
+
+        // OpenGL Draw commands, blended between the last two steps
+        draw(accumulator/TICK_SECONDS, elapsed);
 
         // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
 
         // Poll for Keyboard and mouse events
         glfwPollEvents();
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            last_update_time = current_time;
-        }
     }
 
+    stopThreads();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
@@ -3,29 +3,36 @@
 // Interpolated values from the vertex shaders
 in vec2 fragTexCoord;
 in vec3 objectPositionout;
-in vec3 playerPositionout;
-in float playerAngleout;
-in float levelout;
+in float fragHighlight;      // 1 on the top face of the tile under the hero
 // output data
 out vec3 color;
 
 // Texture sample for the whole mesh
 uniform sampler2D texSampler;
 
+// per frame data : shared by every program, updated once per frame
+layout (std140) uniform FrameData {
+    mat4 VP;
+    vec4 playerPosition;
+    vec4 playerHeading;     // unit vector the hero walks along
+    float spotlightCos;     // cosine of the spotlight's half angle
+};
+
+// The game builds a variant per level lighting : SPOTLIGHT, DIM or neither
 void main()
 {
     // Output color = color from texture sample specified in the vertex shader,
     // interpolated between all 3 surrounding vertices of the triangle
-    vec3 playerDirection = vec3(10*sin((3.14/180)*playerAngleout),0,-10*cos((3.14/180)*playerAngleout));
-    vec3 vertexDirection = objectPositionout-playerPositionout;
-    float angle = acos(dot(playerDirection,vertexDirection)/(length(playerDirection)*length(vertexDirection))) *(180/3.14);
     color = texture( texSampler, fragTexCoord ).rgb;
-    float dist = length(objectPositionout - playerPositionout);
-    if(levelout == 2)
-    if(angle<=25)
-    	color = color * (1.0/dist) * 10.0;
-    else
-	    color = color * (1.0/dist) * 3.0;
-    if(levelout == 3)
-	    color = color *0.7;
+    color = mix(color, vec3(51.0/255.0, 133.0/255.0, 1.0), fragHighlight);
+#ifdef SPOTLIGHT
+    // Falls off with distance, brighter inside the cone the hero faces
+    vec3 toFragment = objectPositionout - playerPosition.xyz;
+    float inverseDist = inversesqrt(dot(toFragment, toFragment));
+    float facing = dot(playerHeading.xyz, toFragment) * inverseDist;
+    color = color * inverseDist * (facing >= spotlightCos ? 10.0 : 3.0);
+#endif
+#ifdef DIM
+    color = color * 0.7;
+#endif
 }
@@ -4,18 +4,21 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 2) in vec2 vertexTexCoord;
 
-uniform mat4 MVP;
+// per frame data : shared by every program, updated once per frame
+layout (std140) uniform FrameData {
+    mat4 VP;
+    vec4 playerPosition;
+    vec4 playerHeading;
+    float spotlightCos;
+};
+
+uniform mat4 model;
 uniform vec3 objectPosition;
-uniform vec3 playerPosition;
-uniform float playerAngle;
-uniform float level;
 
 // output data : used by fragment shader
 out vec2 fragTexCoord;
 out vec3 objectPositionout;
-out vec3 playerPositionout;
-out float playerAngleout;
-out float levelout;
+out float fragHighlight;
 void main ()
 {
     vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
@@ -24,11 +27,11 @@ void main ()
     // to produce the color of each fragment
     fragTexCoord = vertexTexCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * model * v;
 
     objectPositionout = objectPosition + vertexPosition;
-    playerPositionout = playerPosition;
-    playerAngleout = playerAngle;
-    levelout = 1;
+
+    // Only instanced tiles are ever highlighted
+    fragHighlight = 0.0;
 }